@@ -29,9 +29,11 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include "racey-common.h"
 
 int MaxLoop = 50000;
-#define MAX_ELEM 64
+int Reps = 1;
+#define MAX_ELEM RaceyNumElems   /* --elems */
 #define PAGE_SIZE (1 << 10)
 
 #define PRIME1   103072243
@@ -40,16 +42,19 @@ int MaxLoop = 50000;
 int               NumProcs;
 volatile int      startCounter;
 pthread_mutex_t   threadLock;   /* counter mutex */
+pthread_barrier_t repBarrier;   /* main + threads, between repetitions */
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  RACEY_ELEM_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* shared variables */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
-union {
-  /* 64 bytes cache line */
-  char b[64];
-  int value;
-} m[MAX_ELEM];
+char*    sigSlots;  /* sig[i], laid out by --layout */
+#define  SIG(i)   RACEY_SIG(sigSlots, i)
+#define  M(i)     RACEY_ELEM(i)   /* m[i], see racey-common.h */
 
 
 /* the mix function */
@@ -57,15 +62,24 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
-/* The function which is called once the thread is created */
-void* ThreadBody(void* tid)
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
+{
+  int i;
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  for(i = 0; i < MAX_ELEM; i++) {
+    M(i) = mix(i,i);
+  }
+  startCounter = NumProcs;
+}
+
+/* One parallel phase: barrier, then the main loop */
+void ParallelPhase(int threadId)
 {
-  int threadId = *(int *) tid;
   int i;
 
-  printf("SEIZING CPU: %d\n", threadId);
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
   printf("WAIT FOR BARRIER: %d\n", threadId);
 
   /* simple barrier, pass only once */
@@ -78,6 +92,8 @@ void* ThreadBody(void* tid)
   while(startCounter) {};
   printf("STARTING LOOP: %d\n", threadId);
 
+  RaceyPhaseBegin(threadId);
+
   /*
    * main loop:
    *
@@ -88,16 +104,38 @@ void* ThreadBody(void* tid)
    * should change the final value of mix
    */
   for(i = 0 ; i < MaxLoop; i++) {
-    unsigned num = sig[threadId];
+    unsigned num = SIG(threadId);
     unsigned index1 = num%MAX_ELEM;
     unsigned index2;
-    num = mix(num, m[index1].value);
+    num = mix(num, M(index1));
     index2 = num%MAX_ELEM;
-    num = mix(num, m[index2].value);
-    m[index2].value = num;
-    sig[threadId] = num;
+    num = mix(num, M(index2));
+    M(index2) = num;
+    SIG(threadId) = num;
   }
+  RaceyPhaseEnd(threadId, MaxLoop);
   printf("DONE WITH LOOP: %d\n", threadId);
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  int threadId = *(int *) tid;
+  int rep;
+
+  printf("SEIZING CPU: %d\n", threadId);
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase(threadId);
+    /* let main() collect sig[] and reset the shared variables */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
   return NULL;
 }
 
@@ -108,27 +146,28 @@ main(int argc, char* argv[])
   int*           tids;
   pthread_attr_t attr;
   int            ret;
-  int            mix_sig, i;
+  int            mix_sig, i, rep;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
+  assert(Reps > 0);
 
-  /* Initialize the mix array */
-  for(i = 0; i < MAX_ELEM; i++) {
-    m[i].value = mix(i,i);
-  }
-
-  /* Initialize barrier counter */
-  startCounter = NumProcs;
+  /* Initialize the mix array, sig[] and the barrier counter */
+  RaceyAllocElems(0);
+  sigSlots = RaceyAllocSigs(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  InitShared();
 
   /* Initialize array of thread structures */
   threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
@@ -142,6 +181,11 @@ main(int argc, char* argv[])
 
   ret = pthread_mutex_init(&threadLock, NULL);
   assert(ret == 0);
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
+
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyForkServer(NULL, NULL);
 
   for(i=0; i < NumProcs; i++) {
     /* ************************************************************
@@ -156,32 +200,47 @@ main(int argc, char* argv[])
     assert(ret == 0);
   }
 
-  /* Wait for each of the threads to terminate */
-  for(i=0; i < NumProcs; i++) {
-    ret = pthread_join(threads[i], NULL);
-    assert(ret == 0);
-  }
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
+
+    /* compute the result */
+    mix_sig = SIG(0);
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
+
+    /* end of parallel phase */
 
-  /* compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig[i], mix_sig);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
   }
 
-  /* end of parallel phase */
-
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
-
   pthread_mutex_destroy(&threadLock);
+  pthread_barrier_destroy(&repBarrier);
   pthread_attr_destroy(&attr);
 
   return 0;
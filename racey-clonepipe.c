@@ -29,11 +29,21 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include "racey-common.h"
 #include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 int MaxLoop = 50000;
+int Reps = 1;
 #define MAX_ELEM 64
 #define PAGE_SIZE (1 << 10)
 
@@ -43,14 +53,98 @@ int MaxLoop = 50000;
 #define RD 0
 #define WR 1
 
-int  NumProcs;
-int  inputs[33][2];
-int  output[33][2];
+/* a message is MsgSize/4 ints, 16 by default; past PIPE_BUF pipe writes may interleave */
+int  MsgSize = 64;
+int  MsgInts;
+
+int  NumProcs;        /* writers, and input pipes */
+int  NumReaders;      /* one per pipe, or --readers with epoll */
+int  NumThreads;      /* NumProcs + NumReaders */
+int  (*inputs)[2];   /* NumProcs+1 pipes, indexed by thread id */
+int  (*output)[2];   /* indexed by reader id */
+
+/* How readers wait for messages */
+enum { READER_BLOCK, READER_EPOLL };
+const char* Reader = "block";
+int  ReaderKind;
+#define MAX_EVENTS 64
+
+/* What carries the messages */
+enum { TRANSPORT_PIPE, TRANSPORT_RING };
+const char* Transport = "pipe";
+int  TransportKind;
+int  RingSize = 1024;  /* slots per ring, like a 64 KB pipe */
+
+/* Which readers each writer may send to */
+enum { TOPO_ALL, TOPO_RING, TOPO_STAR, TOPO_FANOUT, TOPO_TREE, TOPO_CHAIN };
+const char* Topology = "all";
+int  TopologyKind;
+int  Fanout = 2;      /* children per node with --topology=tree */
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "topology", RACEY_STR, &Topology, "all|ring|star|fanout|tree|chain: who writes to whom" },
+  { "fanout", RACEY_INT, &Fanout, "children per node with --topology=tree" },
+  { "msg-size", RACEY_INT, &MsgSize, "message size in bytes, a multiple of 4" },
+  { "transport", RACEY_STR, &Transport, "pipe|ring: kernel pipes or shared-memory rings" },
+  { "ring-slots", RACEY_INT, &RingSize, "messages per ring, a power of two" },
+  { "reader", RACEY_STR, &Reader, "block|epoll: one blocking reader per pipe, or epoll" },
+  { "readers", RACEY_INT, &NumReaders, "epoll readers, sharing the pipes (default 1)" },
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* shared variables */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
+char*    sigSlots;  /* SIG(i), one cache line per thread */
+#define  SIG(i)   RACEY_SLOT(sigSlots, i, unsigned)
+
+/* Per-thread counters, indexed like the phases */
+struct PipeStats {
+  long writes;       /* write calls, or ring sends */
+  long reads;        /* read calls, or ring receives */
+  long waits;        /* epoll_wait calls */
+  long bytes;        /* bytes received */
+  long sleeps;       /* FUTEX_WAIT on an empty or full ring */
+  long wakes;        /* FUTEX_WAKE */
+  double latency;    /* sum of send-to-receive times, ring only */
+  double maxLatency;
+};
+char*    statSlots;
+#define  STATS(i) RACEY_SLOT(statSlots, i, struct PipeStats)
+
+/* Per input pipe or ring: what went through it, and its depth */
+struct QueueStats {
+  long bytes;
+  long reads;
+  long samples;      /* depth samples, one per DEPTH_EVERY receives */
+  long depth;        /* sum of the queued bytes seen */
+  long maxDepth;
+};
+char*    queueSlots;
+#define  QUEUE(i) RACEY_SLOT(queueSlots, i, struct QueueStats)
+#define  DEPTH_EVERY 16
+
+/* ring latencies, per thread: bucket b counts [2^b, 2^(b+1)) ns */
+#define LAT_BUCKETS 40
+long (*LatHist)[LAT_BUCKETS];
+
+/*
+ * Phase and pin slots.  Blocking readers interleave with the writers,
+ * reader i in slot 2i-1 and writer i in slot 2i; with --reader=epoll the
+ * writers take slots 1..NumProcs and the readers follow.  Pipe i is read
+ * by reader OWNER(i).
+ */
+#define OWNER(i) (((i) - 1) % NumReaders + 1)
+
+int ReaderSlot(int id)
+{
+  return ReaderKind == READER_EPOLL ? NumProcs + id : 2*id - 1;
+}
+
+int WriterSlot(int id)
+{
+  return ReaderKind == READER_EPOLL ? id : 2*id;
+}
 
 
 /* the mix function */
@@ -58,33 +152,372 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
+/* The reader writer w sends its next message to, given num */
+int Target(int w, unsigned num)
+{
+  switch (TopologyKind) {
+  case TOPO_RING:               /* to the next writer's reader */
+    return w % NumProcs + 1;
+  case TOPO_STAR:               /* everyone to reader 1 */
+    return 1;
+  case TOPO_TREE:               /* to the parent, the root to itself */
+    return w == 1 ? 1 : (w - 2) / Fanout + 1;
+  case TOPO_CHAIN:              /* to the next stage, the last to itself */
+    return w < NumProcs ? w + 1 : NumProcs;
+  default:                      /* all, and fanout from writer 1: by signature */
+    return num % NumProcs + 1;
+  }
+}
+
+/* Messages writer w sends: with --topology=fanout only writer 1 sends */
+int WriterLoops(int w)
+{
+  return TopologyKind == TOPO_FANOUT && w != 1 ? 0 : MaxLoop;
+}
+
+/* Every DEPTH_EVERY-th receive from queue i, note the bytes queued in it */
+void SampleDepth(int i, int queued)
+{
+  if (QUEUE(i).reads++ % DEPTH_EVERY != 0)
+    return;
+  if (queued < 0 && ioctl(inputs[i][RD], FIONREAD, &queued) < 0)
+    return;
+  QUEUE(i).samples++;
+  QUEUE(i).depth += queued;
+  if (queued > QUEUE(i).maxDepth)
+    QUEUE(i).maxDepth = queued;
+}
+
+/* Open the reader input and output pipes */
+int OpenPipes()
+{
+  int i, r;
+  for(i=1; i <= NumProcs; i++) {
+    r = pipe(inputs[i]);
+    if (r < 0) {
+      perror("pipe");
+      return -1;
+    }
+    r = pipe(output[i]);
+    if (r < 0) {
+      perror("pipe");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Fork server: the child owns the current pipes, open new ones for the next run */
+void ReopenPipes()
+{
+  int i;
+  for(i=1; i <= NumProcs; i++) {
+    close(inputs[i][RD]);
+    close(inputs[i][WR]);
+    close(output[i][RD]);
+    close(output[i][WR]);
+  }
+  if (OpenPipes() < 0)
+    exit(1);
+}
+
+static inline int futex(volatile int* uaddr, int op, int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/*
+ * --transport=ring: each inputs[i] pipe becomes a bounded MPSC queue in
+ * memory.  A writer claims a position with an atomic add on tail and
+ * waits for its slot to be free (seq == pos); it copies the message in
+ * and publishes it with seq = pos+1.  The reader takes position head
+ * once seq == head+1 and frees the slot for the next lap with
+ * seq = head+size.  Both sides spin a little, then sleep on a futex:
+ * the reader on 'posted' (bumped by every send), writers on 'consumed'
+ * (bumped by every receive), each announcing itself in a sleeping count
+ * so that the other side only pays for FUTEX_WAKE when someone waits.
+ * The reader wakes sleeping writers once per quarter ring, and before it
+ * waits for an empty ring, rather than on every receive.
+ */
+#define RING_SPIN 128
+
+/* a slot is the header and the message, rounded up to whole cache lines */
+struct RingSlot {
+  volatile unsigned seq;
+  double       sent;       /* RaceyNow() at send */
+  int          msg[];
+} __attribute__((aligned(RACEY_CACHE_LINE)));
+
+#define RING_SLOT(q, pos) ((struct RingSlot*)((char*)(q)->slots + \
+                           (size_t)((pos) & (RingSize - 1)) * SlotBytes))
+
+struct Ring {
+  /* writers */
+  volatile unsigned tail __attribute__((aligned(RACEY_CACHE_LINE)));
+  volatile int posted;
+  volatile int readerSleeping;
+  /* the reader */
+  volatile unsigned head __attribute__((aligned(RACEY_CACHE_LINE)));
+  volatile int consumed;
+  volatile int writersSleeping;
+  volatile int closed;
+  struct RingSlot* slots;
+};
+
+struct Ring* rings;  /* NumProcs+1, indexed like inputs[] */
+unsigned RingWakeMask;
+size_t   SlotBytes;
+
+/* (Re)open the rings: allocated on the first call, emptied on later ones */
+void OpenRings()
+{
+  int i, k;
+  if (rings == NULL &&
+      posix_memalign((void**)&rings, RACEY_CACHE_LINE,
+                     (NumProcs + 1) * sizeof(*rings)) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  for (i = 0; i <= NumProcs; i++) {
+    struct RingSlot* slots = rings[i].slots;
+    memset(&rings[i], 0, sizeof(rings[i]));
+    rings[i].slots = slots;
+  }
+  SlotBytes = (offsetof(struct RingSlot, msg) + MsgSize + RACEY_CACHE_LINE - 1)
+              / RACEY_CACHE_LINE * RACEY_CACHE_LINE;
+  for (i = 1; i <= NumProcs; i++) {
+    if (rings[i].slots == NULL &&
+        posix_memalign((void**)&rings[i].slots, RACEY_CACHE_LINE,
+                       RingSize * SlotBytes) != 0) {
+      perror("posix_memalign");
+      exit(1);
+    }
+    for (k = 0; k < RingSize; k++)
+      RING_SLOT(&rings[i], k)->seq = k;
+  }
+  RingWakeMask = RingSize >= 4 ? RingSize/4 - 1 : 0;
+}
+
+/* Writer: returns the bytes sent, like write() */
+int RingSend(int slot, struct Ring* q, const int* msg)
+{
+  const unsigned pos = __sync_fetch_and_add(&q->tail, 1);
+  struct RingSlot* s = RING_SLOT(q, pos);
+  int spins;
+
+  for (spins = 0; s->seq != pos; spins++) {
+    if (spins < RING_SPIN) {
+      RaceyPause();
+      continue;
+    }
+    const int c = q->consumed;
+    __sync_fetch_and_add(&q->writersSleeping, 1);
+    if (s->seq != pos) {
+      STATS(slot).sleeps++;
+      futex(&q->consumed, FUTEX_WAIT_PRIVATE, c);
+    }
+    __sync_fetch_and_sub(&q->writersSleeping, 1);
+  }
+  memcpy(s->msg, msg, MsgSize);
+  s->sent = RaceyNow();
+  __sync_synchronize();
+  s->seq = pos + 1;
+  __sync_fetch_and_add(&q->posted, 1);
+  /* the first writer to see the reader asleep wakes it */
+  if (q->readerSleeping && __sync_bool_compare_and_swap(&q->readerSleeping, 1, 0)) {
+    STATS(slot).wakes++;
+    futex(&q->posted, FUTEX_WAKE_PRIVATE, 1);
+  }
+  return MsgSize;
+}
+
+/* Reader: after freeing slots */
+void RingWakeWriters(int slot, struct Ring* q)
+{
+  __sync_synchronize();
+  if (q->writersSleeping) {
+    STATS(slot).wakes++;
+    futex(&q->consumed, FUTEX_WAKE_PRIVATE, INT_MAX);
+  }
+}
+
+/* Reader: returns the bytes received, or 0 once the ring is closed and empty */
+int RingReceive(int slot, struct Ring* q, int* msg)
+{
+  const unsigned head = q->head;
+  struct RingSlot* s = RING_SLOT(q, head);
+  double latency;
+  int spins, b;
+
+  for (spins = 0; s->seq != head + 1; spins++) {
+    if (spins == 0)
+      RingWakeWriters(slot, q);
+    if (q->closed) {
+      __sync_synchronize();
+      if (s->seq != head + 1)
+        return 0;
+      break;
+    }
+    if (spins < RING_SPIN) {
+      RaceyPause();
+      continue;
+    }
+    const int p = q->posted;
+    q->readerSleeping = 1;
+    __sync_synchronize();
+    if (s->seq != head + 1 && !q->closed) {
+      STATS(slot).sleeps++;
+      futex(&q->posted, FUTEX_WAIT_PRIVATE, p);
+    }
+    q->readerSleeping = 0;
+  }
+  __sync_synchronize();
+  memcpy(msg, s->msg, MsgSize);
+  latency = RaceyNow() - s->sent;
+  __sync_synchronize();
+  s->seq = head + RingSize;
+  q->head = head + 1;
+  q->consumed++;
+  if ((head & RingWakeMask) == 0)
+    RingWakeWriters(slot, q);
+
+  STATS(slot).latency += latency;
+  if (latency > STATS(slot).maxLatency)
+    STATS(slot).maxLatency = latency;
+  for (b = 0; b < LAT_BUCKETS - 1 && latency * 1e9 >= 2L << b; b++)
+    ;
+  LatHist[slot][b]++;
+  return MsgSize;
+}
+
+/* All writers are done: let the reader drain the ring and stop */
+void RingClose(struct Ring* q)
+{
+  q->closed = 1;
+  __sync_fetch_and_add(&q->posted, 1);
+  futex(&q->posted, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/*
+ * --reader=epoll: wait for any of this reader's pipes, and drain each
+ * ready one with nonblocking reads, so data is mixed in readiness order.
+ * Returns when every pipe has hit end of file.
+ */
+unsigned EpollRead(int threadId, unsigned num, long* reads)
+{
+  const int slot = ReaderSlot(threadId);
+  struct epoll_event events[MAX_EVENTS];
+  const int size = 2 * MsgSize;
+  char* buffer = malloc(size);
+  int* numbers = (int*)buffer;
+  int ep, open = 0, i, n, e, k, r;
+
+  ep = epoll_create1(0);
+  if (ep < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  for (i = threadId; i <= NumProcs; i += NumReaders) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+    fcntl(inputs[i][RD], F_SETFL, O_NONBLOCK);
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, inputs[i][RD], &ev) < 0) {
+      perror("epoll_ctl");
+      exit(1);
+    }
+    open++;
+  }
+
+  while (open > 0) {
+    n = epoll_wait(ep, events, MAX_EVENTS, -1);
+    STATS(slot).waits++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (e = 0; e < n; e++) {
+      const int in = events[e].data.u32;
+      const int fd = inputs[in][RD];
+      do {
+        SampleDepth(in, -1);
+        r = read(fd, buffer, size);
+        (*reads)++;
+        if (r < 0)
+          break;
+        num = mix(num, r);
+        for (k = 0; k < r / sizeof(*numbers); k++)
+          num = mix(num, numbers[k]);
+        STATS(slot).bytes += r;
+        QUEUE(in).bytes += r;
+      } while (r > 0);
+      if (r < 0 && errno != EAGAIN) {
+        perror("read");
+        exit(1);
+      }
+      if (r == 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+        open--;
+      }
+    }
+  }
+  close(ep);
+  free(buffer);
+  return num;
+}
+
 void* ReaderThread(void* arg)
 {
   const int threadId = *(int*)arg;
-  char buffer[128];
+  const int slot = ReaderSlot(threadId);
+  const int size = 2 * MsgSize;  /* 128 bytes by default */
+  char* buffer = malloc(size);
   int* numbers = (int*)buffer;
-  int num = sig[threadId];
+  int num = SIG(threadId);
+  long reads = 0;
   int i, k, r;
 
   printf("Reader %d start\n", threadId);
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  //for (i=0; i<0x07ffffff; i++) {};
+  /* bind to a cpu (--pin) and seize it (off unless --warmup is given) */
+  RaceyPin(slot - 1);
+  RaceyWarmup();
   printf("Reader %d go\n", threadId);
 
+  RaceyPhaseBegin(slot);
+
+  if (ReaderKind == READER_EPOLL) {
+    num = EpollRead(threadId, num, &reads);
+    RaceyPhaseEnd(slot, reads);
+    STATS(slot).reads = reads;
+    write(output[threadId][WR], &num, sizeof(num));
+    return NULL;
+  }
+
   /*
    * main loop:
    *
    * If mix() is good, any race (except read-read, which can tell by software)
    * should change the final value of mix
    */
-  for (r = 1; r > 0; ) {
-    r = read(inputs[threadId][RD], buffer, sizeof buffer);
+  for (i = 0, r = 1; r > 0; i++) {
+    if (TransportKind == TRANSPORT_RING) {
+      struct Ring* q = &rings[threadId];
+      SampleDepth(threadId, (q->tail - q->head) * MsgSize);
+      r = RingReceive(slot, q, numbers);
+    } else {
+      SampleDepth(threadId, -1);
+      r = read(inputs[threadId][RD], buffer, size);
+    }
     num = mix(num, r);
     if (r > 0) {
       for (k = 0; k < r / sizeof(*numbers); k++)
         num = mix(num, numbers[k]);
+      STATS(slot).bytes += r;
+      QUEUE(threadId).bytes += r;
     }
   }
+  RaceyPhaseEnd(slot, i);
+  STATS(slot).reads = i;
+  free(buffer);
 
   /* return */
   write(output[threadId][WR], &num, sizeof(num));
@@ -94,39 +527,132 @@ void* ReaderThread(void* arg)
 void* WriterThread(void* arg)
 {
   const int threadId = *(int*)arg;
-  int buffer[16];
-  int num = sig[threadId];
+  const int slot = WriterSlot(threadId);
+  const int loops = WriterLoops(threadId);
+  int* buffer = malloc(MsgSize);
+  int num = SIG(threadId);
   int i, k, r;
 
   printf("Writer %d start\n", threadId);
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  //for (i=0; i<0x07ffffff; i++) {};
+  /* bind to a cpu (--pin) and seize it (off unless --warmup is given) */
+  RaceyPin(slot - 1);
+  RaceyWarmup();
   printf("Writer %d go\n", threadId);
 
+  RaceyPhaseBegin(slot);
+
   /*
    * main loop:
    *
    * If mix() is good, any race (except read-read, which can tell by software)
    * should change the final value of mix
    */
-  for (i = 0; i < MaxLoop; ++i) {
-    for (k = 0; k < sizeof(buffer)/sizeof(*buffer); ++k) {
+  for (i = 0; i < loops; ++i) {
+    for (k = 0; k < MsgInts; ++k) {
       num = mix(num, k * PRIME1);
       num = mix(num, PRIME2 / (k+1));
       buffer[k] = num;
     }
-    const int target = (num % NumProcs) + 1;
-    r = write(inputs[target][WR], buffer, sizeof buffer);
+    const int target = Target(threadId, num);
+    if (TransportKind == TRANSPORT_RING)
+      r = RingSend(slot, &rings[target], buffer);
+    else
+      r = write(inputs[target][WR], buffer, MsgSize);
     num = mix(num, r);
   }
+  RaceyPhaseEnd(slot, loops);
+  STATS(slot).writes = loops;
+  free(buffer);
 
   return NULL;
 }
 
+/*
+ * Upper bound, in microseconds, of the bucket holding the p-quantile,
+ * but no more than the largest latency seen
+ */
+double LatPercentile(const long* hist, long count, double p, double max)
+{
+  long seen = 0;
+  int b;
+  for (b = 0; b < LAT_BUCKETS - 1; b++) {
+    seen += hist[b];
+    if (seen >= p * count)
+      break;
+  }
+  return (2L << b) * 1e-3 < max ? (2L << b) * 1e-3 : max;
+}
+
+void PrintPipeMetrics(double secs)
+{
+  struct PipeStats total = { 0 };
+  long hist[LAT_BUCKETS] = { 0 };
+  long messages, syscalls;
+  int i, b;
+
+  for (i = 1; i <= NumThreads; i++) {
+    total.writes += STATS(i).writes;
+    total.reads += STATS(i).reads;
+    total.waits += STATS(i).waits;
+    total.bytes += STATS(i).bytes;
+    total.sleeps += STATS(i).sleeps;
+    total.wakes += STATS(i).wakes;
+    total.latency += STATS(i).latency;
+    if (STATS(i).maxLatency > total.maxLatency)
+      total.maxLatency = STATS(i).maxLatency;
+    for (b = 0; b < LAT_BUCKETS; b++)
+      hist[b] += LatHist[i][b];
+  }
+  messages = total.bytes / MsgSize;
+  if (TransportKind == TRANSPORT_RING)
+    syscalls = total.sleeps + total.wakes;
+  else
+    syscalls = total.writes + total.reads + total.waits;
+  printf(", \"topology\": \"%s\", \"msg_size\": %d", Topology, MsgSize);
+  if (TopologyKind == TOPO_TREE)
+    printf(", \"fanout\": %d", Fanout);
+  printf(", \"transport\": \"%s\", \"reader\": \"%s\", \"readers\": %d, "
+         "\"messages\": %ld, \"messages_per_sec\": %.0f, "
+         "\"write_syscalls\": %ld, \"read_syscalls\": %ld, "
+         "\"epoll_waits\": %ld, \"futex_waits\": %ld, \"futex_wakes\": %ld, "
+         "\"syscalls_per_message\": %.3f",
+         Transport, Reader, NumReaders, messages,
+         secs > 0 ? messages / secs : 0.0,
+         TransportKind == TRANSPORT_PIPE ? total.writes : 0,
+         TransportKind == TRANSPORT_PIPE ? total.reads : 0,
+         total.waits, total.sleeps, total.wakes,
+         messages > 0 ? (double)syscalls / messages : 0.0);
+  /* pipes give no send time to measure from */
+  if (TransportKind == TRANSPORT_RING && messages > 0)
+    printf(", \"latency_mean_us\": %.3f, \"latency_p50_us\": %.3f, "
+           "\"latency_p99_us\": %.3f, \"latency_max_us\": %.3f",
+           total.latency / messages * 1e6,
+           LatPercentile(hist, messages, 0.5, total.maxLatency * 1e6),
+           LatPercentile(hist, messages, 0.99, total.maxLatency * 1e6),
+           total.maxLatency * 1e6);
+  else
+    printf(", \"latency_mean_us\": null, \"latency_p50_us\": null, "
+           "\"latency_p99_us\": null, \"latency_max_us\": null");
+
+  /* per input pipe or ring, depths in messages */
+  printf(", \"queues\": [");
+  for (i = 1; i <= NumProcs; i++) {
+    struct QueueStats* q = &QUEUE(i);
+    printf("%s{\"pipe\": %d, \"messages\": %ld, \"depth_mean\": %.2f, "
+           "\"depth_max\": %.2f}", i > 1 ? ", " : "", i, q->bytes / MsgSize,
+           q->samples > 0 ? (double)q->depth / q->samples / MsgSize : 0.0,
+           (double)q->maxDepth / MsgSize);
+  }
+  printf("]");
+  memset(statSlots, 0, (size_t)(NumThreads + 1) * RACEY_CACHE_LINE);
+  memset(queueSlots, 0, (size_t)(NumProcs + 1) * RACEY_CACHE_LINE);
+  memset(LatHist, 0, (NumThreads + 1) * sizeof(*LatHist));
+}
+
 int
 main(int argc, char* argv[])
 {
-  int  mix_sig, i, r;
+  int  mix_sig, i, r, last, rep;
   int* tids;
   pthread_t* threads;
 
@@ -134,102 +660,195 @@ main(int argc, char* argv[])
   pthread_attr_init(&attr);
   pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
 
-  /* Parse arguments */
+  /* Parse arguments; the warm-up loop is off by default here */
+  RaceyWarmupIters = 0;
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
+  assert(Reps > 0);
+  if (strcmp(Reader, "block") == 0)
+    ReaderKind = READER_BLOCK;
+  else if (strcmp(Reader, "epoll") == 0)
+    ReaderKind = READER_EPOLL;
+  else {
+    fprintf(stderr, "unknown --reader=%s\n", Reader);
+    exit(1);
+  }
+  if (ReaderKind == READER_BLOCK && NumReaders != 0 && NumReaders != NumProcs) {
+    fprintf(stderr, "--readers=%d needs --reader=epoll\n", NumReaders);
+    exit(1);
+  }
+  if (NumReaders == 0)
+    NumReaders = ReaderKind == READER_EPOLL ? 1 : NumProcs;
+  if (NumReaders < 1 || NumReaders > NumProcs) {
+    fprintf(stderr, "--readers=%d: want 1 to %d\n", NumReaders, NumProcs);
+    exit(1);
+  }
+  NumThreads = NumProcs + NumReaders;
+  if (strcmp(Transport, "pipe") == 0)
+    TransportKind = TRANSPORT_PIPE;
+  else if (strcmp(Transport, "ring") == 0)
+    TransportKind = TRANSPORT_RING;
+  else {
+    fprintf(stderr, "unknown --transport=%s\n", Transport);
+    exit(1);
+  }
+  if (TransportKind == TRANSPORT_RING && ReaderKind == READER_EPOLL) {
+    fprintf(stderr, "--reader=epoll needs --transport=pipe\n");
+    exit(1);
+  }
+  if (MsgSize < (int)sizeof(int) || MsgSize % sizeof(int) != 0) {
+    fprintf(stderr, "--msg-size=%d: want a multiple of %d\n", MsgSize, (int)sizeof(int));
+    exit(1);
+  }
+  MsgInts = MsgSize / sizeof(int);
+  if (strcmp(Topology, "all") == 0)
+    TopologyKind = TOPO_ALL;
+  else if (strcmp(Topology, "ring") == 0)
+    TopologyKind = TOPO_RING;
+  else if (strcmp(Topology, "star") == 0)
+    TopologyKind = TOPO_STAR;
+  else if (strcmp(Topology, "fanout") == 0)
+    TopologyKind = TOPO_FANOUT;
+  else if (strcmp(Topology, "tree") == 0)
+    TopologyKind = TOPO_TREE;
+  else if (strcmp(Topology, "chain") == 0)
+    TopologyKind = TOPO_CHAIN;
+  else {
+    fprintf(stderr, "unknown --topology=%s\n", Topology);
+    exit(1);
+  }
+  if (Fanout < 1) {
+    fprintf(stderr, "--fanout=%d: want at least 1\n", Fanout);
+    exit(1);
+  }
+  if (RingSize < 2 || (RingSize & (RingSize - 1)) != 0) {
+    fprintf(stderr, "--ring-slots=%d: want a power of two\n", RingSize);
+    exit(1);
+  }
+
+  tids = calloc(sizeof(int), NumThreads + 1);
+  threads = calloc(sizeof(pthread_t), NumThreads + 1);
+
+  /* Initialize sig[] */
+  sigSlots = RaceyAllocSlots(NumProcs + 1);
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+
+  RaceyAllocPhases(NumThreads + 1, 0);
+  statSlots = RaceyAllocSlots(NumThreads + 1);
+  queueSlots = RaceyAllocSlots(NumProcs + 1);
+  LatHist = calloc(NumThreads + 1, sizeof(*LatHist));
 
-  tids = calloc(sizeof(int), NumProcs*2 + 1);
-  threads = calloc(sizeof(threads), NumProcs*2 + 1);
+  /* four fds per thread */
+  RaceyRaiseFdLimit();
+  inputs = calloc(NumProcs + 1, sizeof(*inputs));
+  output = calloc(NumProcs + 1, sizeof(*output));
 
   /* Open pipes */
-  for(i=1; i <= NumProcs; i++) {
-    r = pipe(inputs[i]);
-    if (r < 0) {
-      perror("pipe");
-      return 1;
-    }
-    r = pipe(output[i]);
-    if (r < 0) {
-      perror("pipe");
-      return 1;
+  if (OpenPipes() < 0)
+    return 1;
+  if (TransportKind == TRANSPORT_RING)
+    OpenRings();
+
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyMetricsExtra = PrintPipeMetrics;
+  RaceyForkServer(ReopenPipes, NULL);
+
+  for(rep = 0; rep < Reps; rep++) {
+    /* the last phase closed its pipes and rings: open new ones, no warm-up */
+    if (rep > 0) {
+      ReopenPipes();
+      RaceyWarmupIters = 0;
+      if (TransportKind == TRANSPORT_RING)
+        OpenRings();
     }
-  }
 
-  /* Spawn threads */
-  printf("Spawn threads!\n");
-  fflush(stdout);
-  for(i=1; i <= NumProcs*2; i++) {
-    tids[i] = (i+1)/2;
-    printf("Spawning thread %d %d\n", i, tids[i]);
+    /* Spawn threads */
+    printf("Spawn threads!\n");
     fflush(stdout);
-    if (i%2 == 1)
-      r = pthread_create(&threads[i], &attr, ReaderThread, &tids[i]);
-    else
-      r = pthread_create(&threads[i], &attr, WriterThread, &tids[i]);
-    printf("Spawned thread %d\n", i);
-    fflush(stdout);
-    assert(r == 0);
-  }
+    for(i=1; i <= NumThreads; i++) {
+      /* the inverse of ReaderSlot() and WriterSlot() */
+      const int epoll = ReaderKind == READER_EPOLL;
+      const int reader = epoll ? i > NumProcs : i%2 == 1;
+      tids[i] = epoll ? (reader ? i - NumProcs : i) : (i+1)/2;
+      printf("Spawning thread %d %d\n", i, tids[i]);
+      fflush(stdout);
+      if (reader)
+        r = pthread_create(&threads[i], &attr, ReaderThread, &tids[i]);
+      else
+        r = pthread_create(&threads[i], &attr, WriterThread, &tids[i]);
+      printf("Spawned thread %d\n", i);
+      fflush(stdout);
+      assert(r == 0);
+    }
 
-  /* Wait for WriterThreads to terminate */
-  for(i=1; i <= NumProcs*2; i++) {
-    if (i%2 == 0) {
+    /* Wait for WriterThreads to terminate */
+    for(i=1; i <= NumProcs; i++) {
       printf("Waiting for join!\n");
-      r = pthread_join(threads[i], NULL);
+      r = pthread_join(threads[WriterSlot(i)], NULL);
       assert(r == 0);
-      printf("Joined thread %d\n", i);
+      printf("Joined thread %d\n", WriterSlot(i));
     }
-  }
 
-  /* Wait for ReaderThreads to terminate */
-  for (i=1; i <= NumProcs; ++i) {
-    close(inputs[i][WR]);
-  }
+    /* Wait for ReaderThreads to terminate */
+    for (i=1; i <= NumProcs; ++i) {
+      close(inputs[i][WR]);
+      if (TransportKind == TRANSPORT_RING)
+        RingClose(&rings[i]);
+    }
 
-  for(i=1; i <= NumProcs*2; i++) {
-    if (i%2 == 1) {
-      r = pthread_join(threads[i], NULL);
+    for(i=1; i <= NumReaders; i++) {
+      r = pthread_join(threads[ReaderSlot(i)], NULL);
       assert(r == 0);
     }
-  }
 
-  /* Compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    int num = 0;
-    r = read(output[i][RD], &num, sizeof(num));
-    if (r < 0) {
-      perror("read");
-      return 1;
-    }
-    if (r == 0) {
-      fprintf(stderr, "no output from thread %d\n", i);
-      return 1;
+    /*
+     * Compute the result.  Blocking readers leave out the last reader's
+     * result, as they always have, so their signatures stay comparable;
+     * epoll readers mix them all.
+     */
+    mix_sig = SIG(0);
+    last = ReaderKind == READER_EPOLL ? NumReaders : NumProcs - 1;
+    for(i = 1; i <= last ; i++) {
+      int num = 0;
+      r = read(output[i][RD], &num, sizeof(num));
+      if (r < 0) {
+        perror("read");
+        return 1;
+      }
+      if (r == 0) {
+        fprintf(stderr, "no output from thread %d\n", i);
+        return 1;
+      }
+      mix_sig = mix(num, mix_sig);
+      mix_sig = mix(r, mix_sig);
     }
-    mix_sig = mix(num, mix_sig);
-    mix_sig = mix(r, mix_sig);
-  }
 
-  /* end of parallel phase */
+    /* end of parallel phase */
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumThreads);
+    usleep(5);
+  }
 
   return 0;
 }
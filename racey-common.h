@@ -0,0 +1,917 @@
+/*
+ * racey-common.h
+ *
+ * Command line handling, per-thread slots, the shared m[] array and
+ * the layout of sig[] and m[], phase timing and perf counters, cpu
+ * pinning and warm-up, durability for the programs that write a file,
+ * and the fork server, shared by the racey-*.c programs.
+ *
+ * Each program keeps its positional arguments (<numProcesors> <maxLoop>
+ * and so on).  Options of the form "--name=value" (or just "--name" for
+ * flags) may appear anywhere on the command line; each program lists
+ * the options it understands in a table of struct RaceyOption, ended by
+ * an entry with a NULL name.
+ */
+#ifndef RACEY_COMMON_H
+#define RACEY_COMMON_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+enum RaceyOptionType {
+  RACEY_INT,      /* int*, "--name=N" */
+  RACEY_FLAG,     /* int*, set to 1 by "--name" */
+  RACEY_STR,      /* const char**, "--name=S" */
+};
+
+struct RaceyOption {
+  const char* name;
+  int         type;
+  void*       value;
+  const char* help;
+};
+
+/* basename of argv[0], set by RaceyParseArgs() */
+static const char* RaceyProgName = "racey";
+
+/* Options understood by every program */
+static int  RaceyForkServerFd = -1;
+static int  RaceyPinCpus = 0;
+static int  RaceyWarmupMs = -1;
+static int  RaceyWarmupIters = 0x07ffffff;
+static int  RaceyPerf = 0;
+
+/* Set before RaceyParseArgs() when RaceyWarmupIters comes from a parent */
+static int  RaceyWarmupInherited = 0;
+
+#define RACEY_COMMON_OPTIONS \
+  { "forkserver", RACEY_INT, &RaceyForkServerFd, \
+    "run as a fork server on control fd N, status fd N+1" }, \
+  { "pin", RACEY_FLAG, &RaceyPinCpus, \
+    "bind each thread/process to its own cpu" }, \
+  { "warmup", RACEY_INT, &RaceyWarmupMs, \
+    "spin for about N ms before the parallel phase (0 = no warm-up)" }, \
+  { "warmup-iters", RACEY_INT, &RaceyWarmupIters, \
+    "spin for exactly N iterations (default %#x)" }, \
+  { "perf", RACEY_FLAG, &RaceyPerf, \
+    "count cycles, instructions, LLC misses, cs, migrations per thread" }
+
+static inline void RaceyPrintOptions(const struct RaceyOption* opts)
+{
+  for (; opts->name; ++opts) {
+    char buf[64];
+    snprintf(buf, sizeof buf, "--%s%s", opts->name,
+             opts->type == RACEY_FLAG ? "" :
+             opts->type == RACEY_STR  ? "=S" : "=N");
+    fprintf(stderr, "  %-24s ", buf);
+    /* an int option's help may show its default, which a program can set */
+    if (opts->type == RACEY_INT && strchr(opts->help, '%'))
+      fprintf(stderr, opts->help, *(int*)opts->value);
+    else
+      fputs(opts->help, stderr);
+    fputc('\n', stderr);
+  }
+}
+
+static inline int RaceyParseOption(const struct RaceyOption* opts,
+                                   const char* name, size_t len,
+                                   const char* val)
+{
+  for (; opts->name; ++opts) {
+    if (strlen(opts->name) != len || strncmp(opts->name, name, len) != 0)
+      continue;
+    switch (opts->type) {
+    case RACEY_INT:
+      if (!val)
+        return 0;
+      *(int*)opts->value = atoi(val);
+      return 1;
+    case RACEY_FLAG:
+      *(int*)opts->value = 1;
+      return 1;
+    case RACEY_STR:
+      if (!val)
+        return 0;
+      *(const char**)opts->value = val;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Per-thread state.  Arrays indexed by thread id (sig[] and friends) are
+ * allocated at startup for any number of threads, with each thread's
+ * slot on its own cache line so that threads do not false-share.
+ */
+#define RACEY_CACHE_LINE 64
+#define RACEY_SLOT(base, i, type) \
+  (*(type*)((char*)(base) + (size_t)(i) * RACEY_CACHE_LINE))
+
+static inline void* RaceyAllocSlots(int n)
+{
+  void* p;
+  if (posix_memalign(&p, RACEY_CACHE_LINE, (size_t)n * RACEY_CACHE_LINE) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  memset(p, 0, (size_t)n * RACEY_CACHE_LINE);
+  return p;
+}
+
+/*
+ * The shared m[] array.  Element i is the int at the start of the i-th
+ * --stride bytes; threads index it with num % RaceyNumElems, as the
+ * programs always have.  The defaults (64 elements, one cache line each,
+ * in .bss) are the original "union { char b[64]; int value; } m[64]",
+ * so signatures do not change.  The stride defaults to the one chosen
+ * by --layout, below.  Larger --elems spread the races over
+ * L2, the LLC or DRAM.  --backing chooses where the array lives:
+ *
+ *   static   .bss, up to RACEY_STATIC_ELEM_BYTES
+ *   malloc   the heap
+ *   mmap     a private anonymous mapping
+ *   hugetlb  a MAP_HUGETLB mapping (needs /proc/sys/vm/nr_hugepages)
+ *   thp      an anonymous mapping, 2MB aligned, madvise(MADV_HUGEPAGE)
+ *
+ * RaceyAllocElems(1) makes the array shared across fork(), for the
+ * process based programs; there static and malloc mean mmap.
+ */
+#define RACEY_STATIC_ELEM_BYTES (64 << 20)
+#define RACEY_HUGE_PAGE         (2 << 20)
+
+static int         RaceyNumElems = 64;
+static int         RaceyElemStride = 0;
+static const char* RaceyBacking = "static";
+static char*       RaceyElems;
+
+/*
+ * --layout chooses how sig[] and m[] are laid out, to tell the cost of
+ * false sharing (on sig[]) from that of true sharing (on m[]):
+ *
+ *   packed       both are plain int arrays, 16 entries per cache line
+ *   padded64     one 64-byte line per entry (the default)
+ *   padded128    two lines per entry, so the adjacent-line prefetcher
+ *                does not drag in a neighbour's entry
+ *   interleaved  m[] is padded64, and sig[i] lives in the line of m[i],
+ *                right after its value
+ *
+ * Programs place sig[] with RaceyAllocSigs() after RaceyAllocElems(),
+ * and index it with RACEY_SIG().
+ */
+static const char* RaceyLayout = "padded64";
+static int         RaceySigStride = RACEY_CACHE_LINE;
+static int         RaceySigOffset;    /* next free int in interleaved lines */
+
+#define RACEY_ELEM_OPTIONS \
+  { "elems", RACEY_INT, &RaceyNumElems, \
+    "number of elements in the shared m[] array (default 64)" }, \
+  { "stride", RACEY_INT, &RaceyElemStride, \
+    "bytes from one m[] element to the next (default: from --layout)" }, \
+  { "backing", RACEY_STR, &RaceyBacking, \
+    "m[] lives in static (default), malloc, mmap, hugetlb or thp memory" }, \
+  { "layout", RACEY_STR, &RaceyLayout, \
+    "sig[] and m[] are packed, padded64 (default), padded128 or interleaved" }
+
+#define RACEY_SIG(base, i) \
+  (*(unsigned*)((char*)(base) + (size_t)(i) * RaceySigStride))
+
+static inline int RaceyInterleaved(void)
+{
+  return strcmp(RaceyLayout, "interleaved") == 0;
+}
+
+static inline void RaceyApplyLayout(void)
+{
+  if (strcmp(RaceyLayout, "packed") == 0) {
+    RaceySigStride = sizeof(int);
+  } else if (strcmp(RaceyLayout, "padded64") == 0 || RaceyInterleaved()) {
+    RaceySigStride = RACEY_CACHE_LINE;
+  } else if (strcmp(RaceyLayout, "padded128") == 0) {
+    RaceySigStride = 2 * RACEY_CACHE_LINE;
+  } else {
+    fprintf(stderr, "unknown --layout=%s\n", RaceyLayout);
+    exit(1);
+  }
+  if (RaceyElemStride == 0)
+    RaceyElemStride = RaceySigStride;
+  if (RaceyInterleaved()) {
+    RaceySigStride = RaceyElemStride;
+    RaceySigOffset = sizeof(int);
+  }
+}
+
+#define RACEY_ELEM(i) \
+  (*(int*)(RaceyElems + (size_t)(i) * RaceyElemStride))
+
+static inline void RaceyAllocElems(int shared)
+{
+  static char __attribute__((aligned(4096))) store[RACEY_STATIC_ELEM_BYTES];
+  const int share = shared ? MAP_SHARED : MAP_PRIVATE;
+  size_t size, len;
+  char* p;
+
+  RaceyApplyLayout();
+  if (RaceyNumElems <= 0 || RaceyElemStride < (int)sizeof(int) ||
+      RaceyElemStride % sizeof(int) != 0) {
+    fprintf(stderr, "bad --elems=%d --stride=%d\n",
+            RaceyNumElems, RaceyElemStride);
+    exit(1);
+  }
+  size = (size_t)RaceyNumElems * RaceyElemStride;
+
+  if (!shared && strcmp(RaceyBacking, "static") == 0) {
+    if (size > sizeof store) {
+      fprintf(stderr, "--backing=static holds at most %d bytes, "
+              "m[] needs %zu\n", RACEY_STATIC_ELEM_BYTES, size);
+      exit(1);
+    }
+    RaceyElems = store;
+  } else if (!shared && strcmp(RaceyBacking, "malloc") == 0) {
+    if (posix_memalign((void**)&RaceyElems, RACEY_CACHE_LINE, size) != 0) {
+      perror("posix_memalign");
+      exit(1);
+    }
+  } else if (strcmp(RaceyBacking, "static") == 0 ||
+             strcmp(RaceyBacking, "malloc") == 0 ||
+             strcmp(RaceyBacking, "mmap") == 0) {
+    RaceyElems = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                      share|MAP_ANONYMOUS, -1, 0);
+    if (RaceyElems == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+  } else if (strcmp(RaceyBacking, "hugetlb") == 0) {
+    len = (size + RACEY_HUGE_PAGE - 1) & ~(size_t)(RACEY_HUGE_PAGE - 1);
+    RaceyElems = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                      share|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (RaceyElems == MAP_FAILED) {
+      perror("mmap(MAP_HUGETLB), check /proc/sys/vm/nr_hugepages");
+      exit(1);
+    }
+  } else if (strcmp(RaceyBacking, "thp") == 0) {
+    /* over-allocate so the array can start on a huge page boundary */
+    len = size + RACEY_HUGE_PAGE;
+    p = mmap(NULL, len, PROT_READ|PROT_WRITE, share|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    RaceyElems = (char*)(((size_t)p + RACEY_HUGE_PAGE - 1) &
+                         ~(size_t)(RACEY_HUGE_PAGE - 1));
+    if (madvise(RaceyElems, size, MADV_HUGEPAGE) < 0)
+      perror("madvise(MADV_HUGEPAGE)");
+  } else {
+    fprintf(stderr, "unknown --backing=%s\n", RaceyBacking);
+    exit(1);
+  }
+}
+
+/*
+ * Allocate sig[] for n threads, laid out by --layout.  With interleaved,
+ * each call takes the next free int in every m[] line, so m[] must
+ * have at least n elements.
+ */
+static inline char* RaceyAllocSigs(int n)
+{
+  char* p;
+
+  if (RaceyInterleaved()) {
+    if (RaceyNumElems < n ||
+        RaceySigOffset + (int)sizeof(unsigned) > RaceyElemStride) {
+      fprintf(stderr, "--layout=interleaved needs --elems >= %d and "
+              "a larger --stride\n", n);
+      exit(1);
+    }
+    p = RaceyElems + RaceySigOffset;
+    RaceySigOffset += sizeof(unsigned);
+    return p;
+  }
+  if (posix_memalign((void**)&p, RACEY_CACHE_LINE,
+                     (size_t)n * RaceySigStride) != 0) {
+    perror("posix_memalign");
+    exit(1);
+  }
+  memset(p, 0, (size_t)n * RaceySigStride);
+  return p;
+}
+
+/* Programs with several fds per thread need more than the default 1024 */
+static inline void RaceyRaiseFdLimit(void)
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/*
+ * Warm-up: before the parallel phase each thread spins in a tight loop
+ * to gain a long time slice from the OS scheduler.  The loop runs a
+ * fixed number of iterations (--warmup-iters), so runs under DMP stay
+ * deterministic.  --warmup=MS instead measures how many iterations take
+ * MS milliseconds on this machine, once at startup.
+ */
+static inline void RaceySpin(long iters)
+{
+  long i;
+  for (i = 0; i < iters; i++) {
+    __asm__ __volatile__("" ::: "memory");
+  }
+}
+
+/* one iteration of a spin-wait loop */
+static inline void RaceyPause(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline double RaceyNow(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline void RaceyCalibrateWarmup(void)
+{
+  long chunk = 1 << 16;
+  double t0, t;
+
+  if (RaceyWarmupMs < 0 || RaceyWarmupInherited)
+    return;
+  if (RaceyWarmupMs == 0) {
+    RaceyWarmupIters = 0;
+    return;
+  }
+  /* grow the sample until it takes at least 10ms */
+  for (;;) {
+    t0 = RaceyNow();
+    RaceySpin(chunk);
+    t = RaceyNow() - t0;
+    if (t >= 0.01 || chunk >= (1L << 40))
+      break;
+    chunk *= 2;
+  }
+  t = chunk * (RaceyWarmupMs / 1000.0) / t;
+  if (t > 0x7fffffff) {
+    fprintf(stderr, "%s: --warmup=%d needs %.0f iterations, capped at %d "
+            "(about %.0f ms)\n", RaceyProgName, RaceyWarmupMs, t, 0x7fffffff,
+            RaceyWarmupMs * (0x7fffffff / t));
+    t = 0x7fffffff;
+  }
+  RaceyWarmupIters = (int)t;
+}
+
+static inline void RaceyWarmup(void)
+{
+  RaceySpin(RaceyWarmupIters);
+}
+
+/*
+ * Perf counters (--perf).  Around its parallel phase each thread opens
+ * one perf_event_open() group on itself.  Events that cannot be opened
+ * (no PMU in a container or VM, perf_event_paranoid) read as -1 and are
+ * reported as null; the software events still work there.  Kernel time
+ * is counted when allowed, otherwise user time only.
+ */
+#define RACEY_NPERF 5
+
+static const struct {
+  const char* name;
+  unsigned    type;
+  unsigned    config;
+} RaceyPerfEvents[RACEY_NPERF] = {
+  { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "llc_misses",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  { "cpu_migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+static __thread int RaceyPerfFds[RACEY_NPERF];
+
+static inline int RaceyPerfOpen(int e, int group)
+{
+  struct perf_event_attr attr;
+  int fd, user_only;
+
+  for (user_only = 0; user_only <= 1; user_only++) {
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = RaceyPerfEvents[e].type;
+    attr.config = RaceyPerfEvents[e].config;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    if (fd < 0 && group >= 0)
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0)
+      return fd;
+  }
+  return -1;
+}
+
+static inline void RaceyPerfStart(void)
+{
+  static int warned;
+  int e, group = -1, failed = 0;
+
+  for (e = 0; e < RACEY_NPERF; e++) {
+    RaceyPerfFds[e] = RaceyPerfOpen(e, group);
+    if (RaceyPerfFds[e] < 0)
+      failed++;
+    else if (group < 0)
+      group = RaceyPerfFds[e];
+  }
+  if (failed && __sync_bool_compare_and_swap(&warned, 0, 1))
+    fprintf(stderr, "%s: %d of %d perf events unavailable, reported as null "
+            "(see /proc/sys/kernel/perf_event_paranoid)\n",
+            RaceyProgName, failed, RACEY_NPERF);
+}
+
+static inline void RaceyPerfStop(long long* counts)
+{
+  int e;
+
+  for (e = 0; e < RACEY_NPERF; e++) {
+    counts[e] = -1;
+    if (RaceyPerfFds[e] < 0)
+      continue;
+    if (read(RaceyPerfFds[e], &counts[e], sizeof counts[e]) != sizeof counts[e])
+      counts[e] = -1;
+  }
+  for (e = RACEY_NPERF - 1; e >= 0; e--)
+    if (RaceyPerfFds[e] >= 0)
+      close(RaceyPerfFds[e]);
+}
+
+/* counts[] as JSON members, -1 as null */
+static inline void RaceyPrintPerf(const long long* counts)
+{
+  int e;
+
+  printf(", \"perf\": {");
+  for (e = 0; e < RACEY_NPERF; e++) {
+    printf("%s\"%s\": ", e ? ", " : "", RaceyPerfEvents[e].name);
+    if (counts[e] < 0)
+      printf("null");
+    else
+      printf("%lld", counts[e]);
+  }
+  printf("}");
+}
+
+/*
+ * Durability, for the programs that write a file (racey-mmaptmpfile,
+ * racey-writefile).  The file goes in --dir.  After every --sync-every
+ * writes (iterations) a thread makes them durable, a "commit":
+ *
+ *   none        never (the default)
+ *   msync       msync(MS_SYNC) of the program's shared mapping
+ *   fdatasync   fdatasync() of the file
+ *   group       group commit: the thread waits for an fdatasync() that
+ *               started after its writes; if none is running it runs
+ *               one itself, on behalf of everyone who queued meanwhile
+ *
+ * Every msync()/fdatasync() call is a "flush"; the metrics line
+ * reports commits, commits_per_sec, flushes and flush latency
+ * percentiles (from up to RACEY_SYNC_SAMPLES flushes per phase).
+ */
+enum { RACEY_SYNC_NONE, RACEY_SYNC_MSYNC, RACEY_SYNC_FDATASYNC, RACEY_SYNC_GROUP };
+#define RACEY_SYNC_SAMPLES (1 << 16)
+
+static const char* RaceyTempDir = ".";
+static const char* RaceySync = "none";
+static int         RaceySyncEvery = 1;
+static int         RaceySyncKind;
+static int         RaceySyncFd = -1;
+static void*       RaceySyncMap;
+static size_t      RaceySyncLen;
+static __thread long RaceySyncWrites;
+
+static volatile long RaceyCommits, RaceyFlushes;
+static float*        RaceyFlushSecs;   /* the first RACEY_SYNC_SAMPLES flushes */
+
+/* group commit: flushes are numbered; started/ended are the last ones */
+static pthread_mutex_t RaceyGroupLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  RaceyGroupDone = PTHREAD_COND_INITIALIZER;
+static long            RaceyGroupStarted, RaceyGroupEnded;
+static int             RaceyGroupFlushing;
+
+#define RACEY_SYNC_OPTIONS \
+  { "dir", RACEY_STR, &RaceyTempDir, \
+    "directory of the file (compare tmpfs and disk)" }, \
+  { "sync", RACEY_STR, &RaceySync, \
+    "make writes durable: none, msync, fdatasync or group" }, \
+  { "sync-every", RACEY_INT, &RaceySyncEvery, \
+    "writes (iterations) per commit" }
+
+/* Create and open path: prefix.XXXXXX in --dir */
+static inline int RaceyMkstemp(char* path, size_t size, const char* prefix)
+{
+  int fd;
+  snprintf(path, size, "%s/%s.XXXXXX", RaceyTempDir, prefix);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+/* Check --sync once the file is open; map/len is its shared mapping, if any */
+static inline void RaceySyncSetup(int fd, void* map, size_t len)
+{
+  if (strcmp(RaceySync, "none") == 0)
+    RaceySyncKind = RACEY_SYNC_NONE;
+  else if (strcmp(RaceySync, "msync") == 0 && map)
+    RaceySyncKind = RACEY_SYNC_MSYNC;
+  else if (strcmp(RaceySync, "fdatasync") == 0)
+    RaceySyncKind = RACEY_SYNC_FDATASYNC;
+  else if (strcmp(RaceySync, "group") == 0)
+    RaceySyncKind = RACEY_SYNC_GROUP;
+  else {
+    fprintf(stderr, "unsupported --sync=%s\n", RaceySync);
+    exit(1);
+  }
+  if (RaceySyncEvery <= 0) {
+    fprintf(stderr, "--sync-every=%d: want at least 1\n", RaceySyncEvery);
+    exit(1);
+  }
+  RaceySyncFd = fd;
+  RaceySyncMap = map;
+  RaceySyncLen = len;
+  RaceyFlushSecs = calloc(RACEY_SYNC_SAMPLES, sizeof *RaceyFlushSecs);
+  if (!RaceyFlushSecs) {
+    perror("calloc");
+    exit(1);
+  }
+}
+
+static inline void RaceyFlush(void)
+{
+  const double start = RaceyNow();
+  long n;
+  int ret = (RaceySyncKind == RACEY_SYNC_MSYNC)
+    ? msync(RaceySyncMap, RaceySyncLen, MS_SYNC)
+    : fdatasync(RaceySyncFd);
+  if (ret < 0) {
+    perror(RaceySync);
+    exit(1);
+  }
+  n = __sync_fetch_and_add(&RaceyFlushes, 1);
+  if (n < RACEY_SYNC_SAMPLES)
+    RaceyFlushSecs[n] = RaceyNow() - start;
+}
+
+static inline void RaceyGroupCommit(void)
+{
+  long need, mine;
+
+  pthread_mutex_lock(&RaceyGroupLock);
+  need = RaceyGroupStarted + 1;   /* the first flush to start after my writes */
+  while (RaceyGroupEnded < need) {
+    if (RaceyGroupFlushing) {
+      pthread_cond_wait(&RaceyGroupDone, &RaceyGroupLock);
+      continue;
+    }
+    RaceyGroupFlushing = 1;
+    mine = ++RaceyGroupStarted;
+    pthread_mutex_unlock(&RaceyGroupLock);
+    RaceyFlush();
+    pthread_mutex_lock(&RaceyGroupLock);
+    RaceyGroupFlushing = 0;
+    RaceyGroupEnded = mine;
+    pthread_cond_broadcast(&RaceyGroupDone);
+  }
+  pthread_mutex_unlock(&RaceyGroupLock);
+}
+
+/* Called after each write (iteration): commit every --sync-every */
+static inline void RaceySyncPoint(void)
+{
+  if (RaceySyncKind == RACEY_SYNC_NONE || ++RaceySyncWrites % RaceySyncEvery)
+    return;
+  __sync_fetch_and_add(&RaceyCommits, 1);
+  if (RaceySyncKind == RACEY_SYNC_GROUP)
+    RaceyGroupCommit();
+  else
+    RaceyFlush();
+}
+
+static inline int RaceyCompareFloats(const void* a, const void* b)
+{
+  const float x = *(const float*)a, y = *(const float*)b;
+  return (x > y) - (x < y);
+}
+
+/* The durability members of the metrics line, then reset the counts */
+static inline void RaceyPrintSync(double secs)
+{
+  const long n = RaceyFlushes < RACEY_SYNC_SAMPLES ? RaceyFlushes : RACEY_SYNC_SAMPLES;
+  const double pct[] = { 50, 90, 99 };
+  int i;
+
+  printf(", \"sync\": \"%s\", \"sync_every\": %d, \"commits\": %ld, "
+         "\"commits_per_sec\": %.0f, \"flushes\": %ld",
+         RaceySync, RaceySyncEvery, RaceyCommits,
+         secs > 0 ? RaceyCommits / secs : 0.0, RaceyFlushes);
+  qsort(RaceyFlushSecs, n, sizeof *RaceyFlushSecs, RaceyCompareFloats);
+  for (i = 0; i < 3; i++)
+    printf(", \"flush_p%.0f_us\": %.1f", pct[i],
+           n ? RaceyFlushSecs[(long)((n - 1) * pct[i] / 100)] * 1e6 : 0.0);
+  printf(", \"flush_max_us\": %.1f", n ? RaceyFlushSecs[n - 1] * 1e6 : 0.0);
+  RaceyCommits = RaceyFlushes = 0;
+}
+
+/*
+ * Metrics.  Each thread stamps the start and the end of its parallel
+ * phase, and how many iterations it ran, in its own slot.  After each
+ * signature main() calls RaceyReportMetrics(), which prints one JSON
+ * object on a line of its own and clears the slots for the next phase:
+ *
+ *   program, rep, threads, signature
+ *   phase_secs, iters, iters_per_sec   first start to last end, all threads
+ *   layout, elems, stride, sig_stride  programs with an m[] array only
+ *   sync, commits, flush_p50_us, ...   with --sync, see above
+ *   per_thread                         [{id, secs, iters, iters_per_sec}]
+ *   perf                               with --perf: totals, and per thread
+ *   rusage                             getrusage(RUSAGE_SELF)
+ *   rusage_children                    reaped children (forked programs)
+ *
+ * A program can add members of its own (its variant options, counts)
+ * by pointing RaceyMetricsExtra at a function that prints them, each
+ * as ", \"name\": value"; it is passed phase_secs, to print rates.
+ *
+ * test.pl and raceyrun only look at the signature line.
+ */
+struct RaceyPhase {
+  double    start, end;
+  long      iters;
+  long long perf[RACEY_NPERF];   /* --perf counts, -1 if unavailable */
+};
+/* each phase must fit in its slot */
+typedef char RaceyPhaseFitsSlot[sizeof(struct RaceyPhase) <= RACEY_CACHE_LINE ? 1 : -1];
+
+static char* RaceyPhases;
+static void  (*RaceyMetricsExtra)(double secs);
+#define RACEY_PHASE(i) RACEY_SLOT(RaceyPhases, i, struct RaceyPhase)
+
+/* n zeroed slots in a MAP_SHARED mapping, seen by fork()ed children */
+static inline void* RaceyAllocSharedSlots(int n)
+{
+  void* p = mmap(NULL, (size_t)n * RACEY_CACHE_LINE,
+                 PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return p;
+}
+
+/* n slots; shared with fork()ed children if 'shared' */
+static inline void RaceyAllocPhases(int n, int shared)
+{
+  RaceyPhases = shared ? RaceyAllocSharedSlots(n) : RaceyAllocSlots(n);
+}
+
+static inline void RaceyPhaseBegin(int i)
+{
+  if (RaceyPerf)
+    RaceyPerfStart();
+  RACEY_PHASE(i).start = RaceyNow();
+}
+
+static inline void RaceyPhaseEnd(int i, long iters)
+{
+  RACEY_PHASE(i).end = RaceyNow();
+  RACEY_PHASE(i).iters = iters;
+  if (RaceyPerf)
+    RaceyPerfStop(RACEY_PHASE(i).perf);
+}
+
+static inline double RaceyTvSecs(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static inline void RaceyPrintRusage(const char* name, int who)
+{
+  struct rusage ru;
+  if (getrusage(who, &ru) < 0)
+    memset(&ru, 0, sizeof ru);
+  printf(", \"%s\": {\"utime\": %.6f, \"stime\": %.6f, \"maxrss_kb\": %ld, "
+         "\"minflt\": %ld, \"majflt\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld}",
+         name, RaceyTvSecs(ru.ru_utime), RaceyTvSecs(ru.ru_stime),
+         ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw, ru.ru_nivcsw);
+}
+
+/* Slots first..last are the threads of this phase, whose result was sig */
+static inline void RaceyReportMetrics(unsigned sig, int first, int last)
+{
+  static int rep;
+  double start = 0, end = 0;
+  long iters = 0;
+  long long perf[RACEY_NPERF];
+  int i, e;
+
+  for (e = 0; e < RACEY_NPERF; e++)
+    perf[e] = -1;
+  for (i = first; i <= last; i++) {
+    struct RaceyPhase* ph = &RACEY_PHASE(i);
+    if (start == 0 || ph->start < start)
+      start = ph->start;
+    if (ph->end > end)
+      end = ph->end;
+    iters += ph->iters;
+    for (e = 0; e < RACEY_NPERF; e++)
+      if (ph->perf[e] >= 0)
+        perf[e] = (perf[e] < 0 ? 0 : perf[e]) + ph->perf[e];
+  }
+
+  printf("{\"program\": \"%s\", \"rep\": %d, \"threads\": %d, "
+         "\"signature\": \"%08x\", \"phase_secs\": %.6f, \"iters\": %ld, "
+         "\"iters_per_sec\": %.0f",
+         RaceyProgName, rep++, last - first + 1, sig, end - start, iters,
+         end > start ? iters / (end - start) : 0.0);
+  if (RaceyElems)
+    printf(", \"layout\": \"%s\", \"elems\": %d, \"stride\": %d, "
+           "\"sig_stride\": %d",
+           RaceyLayout, RaceyNumElems, RaceyElemStride, RaceySigStride);
+  if (RaceyMetricsExtra)
+    RaceyMetricsExtra(end - start);
+  if (RaceySyncKind != RACEY_SYNC_NONE)
+    RaceyPrintSync(end - start);
+  if (RaceyPerf)
+    RaceyPrintPerf(perf);
+  printf(", \"per_thread\": [");
+  for (i = first; i <= last; i++) {
+    struct RaceyPhase* ph = &RACEY_PHASE(i);
+    double secs = ph->end - ph->start;
+    printf("%s{\"id\": %d, \"secs\": %.6f, \"iters\": %ld, "
+           "\"iters_per_sec\": %.0f", i > first ? ", " : "",
+           i, secs, ph->iters, secs > 0 ? ph->iters / secs : 0.0);
+    if (RaceyPerf)
+      RaceyPrintPerf(ph->perf);
+    printf("}");
+  }
+  printf("]");
+  RaceyPrintRusage("rusage", RUSAGE_SELF);
+  RaceyPrintRusage("rusage_children", RUSAGE_CHILDREN);
+  printf("}\n");
+  fflush(stdout);
+  memset(&RACEY_PHASE(first), 0, (size_t)(last - first + 1) * RACEY_CACHE_LINE);
+}
+
+/*
+ * With --pin, bind the calling thread (or process) to one cpu: slot i
+ * gets the i-th cpu we were allowed to run on at startup, wrapping
+ * around.  Uses the raw syscalls to avoid depending on _GNU_SOURCE.
+ */
+#define RACEY_MAX_CPUS 4096
+#define RACEY_LONG_BITS (8 * sizeof(unsigned long))
+#define RACEY_CPU_ISSET(cpu, set) \
+  ((set)[(cpu) / RACEY_LONG_BITS] & (1UL << ((cpu) % RACEY_LONG_BITS)))
+
+static unsigned long RaceyAllowedCpus[RACEY_MAX_CPUS / RACEY_LONG_BITS];
+static int           RaceyNumCpus;
+
+/* Record the cpus we may use; called from RaceyParseArgs() */
+static inline void RaceyInitCpus(void)
+{
+  int cpu;
+  if (syscall(SYS_sched_getaffinity, 0, sizeof RaceyAllowedCpus,
+              RaceyAllowedCpus) < 0) {
+    perror("sched_getaffinity");
+    return;
+  }
+  for (cpu = 0; cpu < RACEY_MAX_CPUS; ++cpu)
+    if (RACEY_CPU_ISSET(cpu, RaceyAllowedCpus))
+      RaceyNumCpus++;
+}
+
+static inline void RaceyPin(int slot)
+{
+  unsigned long mask[RACEY_MAX_CPUS / RACEY_LONG_BITS];
+  int cpu, n;
+
+  if (!RaceyPinCpus || RaceyNumCpus == 0)
+    return;
+
+  /* find the (slot % ncpus)'th allowed cpu */
+  n = slot % RaceyNumCpus;
+  for (cpu = 0; cpu < RACEY_MAX_CPUS; ++cpu)
+    if (RACEY_CPU_ISSET(cpu, RaceyAllowedCpus) && n-- == 0)
+      break;
+
+  memset(mask, 0, sizeof mask);
+  mask[cpu / RACEY_LONG_BITS] = 1UL << (cpu % RACEY_LONG_BITS);
+  if (syscall(SYS_sched_setaffinity, 0, sizeof mask, mask) < 0)
+    perror("sched_setaffinity");
+}
+
+/*
+ * Parse all "--" options out of argv, leaving the positional arguments
+ * in argv[1..].  Returns the new argc.  Exits with a usage message on an
+ * unknown option.
+ */
+static inline int RaceyParseArgs(int argc, char* argv[],
+                                 const struct RaceyOption* opts)
+{
+  int i, n = 1;
+  for (i = 1; i < argc; ++i) {
+    const char* name = argv[i] + 2;
+    const char* val;
+    if (strncmp(argv[i], "--", 2) != 0) {
+      argv[n++] = argv[i];
+      continue;
+    }
+    val = strchr(name, '=');
+    if (!RaceyParseOption(opts, name, val ? (size_t)(val - name) : strlen(name),
+                          val ? val + 1 : NULL)) {
+      if (strcmp(name, "help") != 0)
+        fprintf(stderr, "%s: bad option '%s'\n", argv[0], argv[i]);
+      fprintf(stderr, "Options:\n");
+      RaceyPrintOptions(opts);
+      exit(1);
+    }
+  }
+  argv[n] = NULL;
+  RaceyProgName = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  RaceyInitCpus();
+  RaceyCalibrateWarmup();
+  return n;
+}
+
+/*
+ * Fork server (enabled by --forkserver=N).
+ *
+ * Call this once setup is done, right before the parallel phase.  The
+ * process parks here, and for every 4-byte request read from fd N it
+ * forks a child.  The child returns from RaceyForkServer() and runs the
+ * rest of main() from the already initialized image.  The server writes
+ * the child's pid to fd N+1, waits for it, then writes its wait status
+ * to fd N+1 (the same protocol as AFL's fork server).  The server exits
+ * when fd N is closed.
+ *
+ * 'detach' runs in the server right after each fork, to drop anything
+ * the child must own alone (e.g. pipe ends, which must not stay open in
+ * the server) and prepare fresh ones for the next child.  'reset' runs
+ * after each child exits, to restore state the child shares with the
+ * server (MAP_SHARED memory, file offsets).  Either may be NULL.
+ */
+static inline void RaceyForkServer(void (*detach)(void), void (*reset)(void))
+{
+  const int ctl = RaceyForkServerFd;
+  const int st = RaceyForkServerFd + 1;
+  int req, status;
+  pid_t pid;
+
+  if (ctl < 0)
+    return;
+
+  fflush(stdout);
+  fflush(stderr);
+  while (read(ctl, &req, sizeof req) == sizeof req) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    if (pid == 0) {
+      close(ctl);
+      close(st);
+      return;
+    }
+    if (detach)
+      detach();
+    if (write(st, &pid, sizeof pid) != sizeof pid)
+      break;
+    if (waitpid(pid, &status, 0) < 0)
+      status = -1;
+    if (reset)
+      reset();
+    if (write(st, &status, sizeof status) != sizeof status)
+      break;
+  }
+  exit(0);
+}
+
+#endif /* RACEY_COMMON_H */
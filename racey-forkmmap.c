@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include "racey-common.h"
 #include <string.h>
 #include <memory.h>
 #include <sys/mman.h>
@@ -36,31 +37,35 @@
 #include <sys/wait.h>
 
 int MaxLoop = 50000;
-#define MAX_ELEM 64
+int Reps = 1;
+#define MAX_ELEM RaceyNumElems   /* --elems */
 #define PAGE_SIZE (1 << 10)
 
 #define PRIME1   103072243
 #define PRIME2   103995407
 
-/* shared variables */
+/* shared variables; m[] is a separate shared mapping, see racey-common.h */
+#define M(i) RACEY_ELEM(i)
+
 struct Shared {
   unsigned waiting;
-  unsigned sig[33];
 
-  union {
-    /* 64 bytes cache line */
-    char b[64];
-    int value;
-  } m[MAX_ELEM];
+  /* sig[i], laid out by --layout, NumProcs+1 of them */
+  char sig[] __attribute__((aligned(RACEY_CACHE_LINE)));
 };
+#define SHARED_SIG(i) RACEY_SIG(SharedSigs, i)
 
 int               NumProcs;
 struct Shared*    SHARED;
-
-/* shared initialization */
-const unsigned sig_init[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                                16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                                30, 31, 32 };
+size_t            SharedSize;
+char*             SharedSigs;  /* SHARED->sig, or inside m[] if interleaved */
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  RACEY_ELEM_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 
 /* the mix function */
@@ -68,6 +73,19 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
+/* (Re)initialize the shared page */
+void InitShared()
+{
+  int i;
+  SHARED->waiting = NumProcs;
+  for(i = 0; i <= NumProcs; i++) {
+    SHARED_SIG(i) = i;
+  }
+  for(i = 0; i < MAX_ELEM; i++) {
+    M(i) = mix(i,i);
+  }
+}
+
 /* The function which is called once the process is created */
 void ChildProcess(int threadId)
 {
@@ -75,8 +93,9 @@ void ChildProcess(int threadId)
 
 //  printf("CHILD SPAWN: %d\n", threadId);
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
 
 //  printf("CHILD ARRIVE: %d\n", threadId);
 
@@ -87,6 +106,8 @@ void ChildProcess(int threadId)
 //    }
 //  }
 
+  RaceyPhaseBegin(threadId);
+
   /*
    * main loop:
    *
@@ -97,15 +118,16 @@ void ChildProcess(int threadId)
    * should change the final value of mix
    */
   for(i = 0 ; i < MaxLoop; i++) {
-    unsigned num = SHARED->sig[threadId];
+    unsigned num = SHARED_SIG(threadId);
     unsigned index1 = num%MAX_ELEM;
     unsigned index2;
-    num = mix(num, SHARED->m[index1].value);
+    num = mix(num, M(index1));
     index2 = num%MAX_ELEM;
-    num = mix(num, SHARED->m[index2].value);
-    SHARED->m[index2].value = num;
-    SHARED->sig[threadId] = num;
+    num = mix(num, M(index2));
+    M(index2) = num;
+    SHARED_SIG(threadId) = num;
   }
+  RaceyPhaseEnd(threadId, MaxLoop);
 
 //  printf("CHILD EXIT: %d\n", threadId);
 }
@@ -115,81 +137,99 @@ main(int argc, char* argv[])
 {
   int* pids;
   int  ret;
-  int  mix_sig, i, k;
+  int  mix_sig, i, k, rep;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
+  assert(Reps > 0);
 
   pids = calloc(sizeof(int), NumProcs*2);
 
-  /* Allocate the shared page */
-  SHARED = mmap(NULL, 8*4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  /* Allocate the shared page and m[], which is shared too */
+  RaceyAllocElems(1);
+  SharedSize = sizeof(struct Shared) + (NumProcs + 1) * RaceySigStride;
+  SHARED = mmap(NULL, SharedSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
   if (!SHARED || SHARED == MAP_FAILED) {
     perror("mmap");
     return 1;
   }
 printf("SHARED (a): %p\n", SHARED);
-printf("SHARED (z): %p\n", ((char*)SHARED) + 8*4096);
+printf("SHARED (z): %p\n", ((char*)SHARED) + SharedSize);
+  SharedSigs = RaceyInterleaved() ? RaceyAllocSigs(NumProcs + 1) : SHARED->sig;
+  RaceyAllocPhases(NumProcs + 1, 1);
 
-  SHARED->waiting = NumProcs;
-  memcpy(SHARED->sig, sig_init, sizeof(SHARED->sig));
-  for(i = 0; i < MAX_ELEM; i++) {
-    SHARED->m[i].value = mix(i,i);
-  }
+  InitShared();
 
-  /* Spawn processes */
-  for(i=1; i <= NumProcs; i++) {
-    ret = fork();
-    if (ret < 0) {
-      perror("fork");
-      return 1;
+  /*
+   * Setup is done: with --forkserver, each run starts here.  The child
+   * shares the page with the server, so reset it after each run.
+   */
+  RaceyForkServer(NULL, InitShared);
+
+  for(rep = 0; rep < Reps; rep++) {
+    /* the last phase's children changed the shared page; no warm-up again */
+    if (rep > 0) {
+      InitShared();
+      RaceyWarmupIters = 0;
     }
-    if (ret == 0) {
-      ChildProcess(i);
-      return 0;
+
+    /* Spawn processes */
+    for(i=1; i <= NumProcs; i++) {
+      ret = fork();
+      if (ret < 0) {
+        perror("fork");
+        return 1;
+      }
+      if (ret == 0) {
+        ChildProcess(i);
+        return 0;
+      }
+      pids[i-1] = ret;
     }
-    pids[i-1] = ret;
-  }
 
-  /* compute the result */
-  mix_sig = SHARED->sig[0];
+    /* compute the result */
+    mix_sig = SHARED_SIG(0);
 
-  for(i=1; i <= NumProcs; i++) {
-    ret = wait(NULL);
-    for (k=0; k <= NumProcs; k++) {
-      if (pids[k] == ret) {
+    for(i=1; i <= NumProcs; i++) {
+      ret = wait(NULL);
+      for (k=0; k <= NumProcs; k++) {
+        if (pids[k] == ret) {
 //        printf("R: %d\n", k);
 //        mix_sig = mix(k, mix_sig);
-        break;
+          break;
+        }
       }
     }
-  }
 
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(SHARED->sig[i], mix_sig);
-  }
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SHARED_SIG(i), mix_sig);
+    }
 
-  /* end of parallel phase */
-
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* end of parallel phase */
+
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+  }
 
   return 0;
 }
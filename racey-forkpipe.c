@@ -24,17 +24,33 @@
  * - MaxLoop is an optional command line parameter
  * - Can spawn 32 threads (previous max was 15)
  */
+#define _GNU_SOURCE     /* vmsplice, F_SETPIPE_SZ, pipe2, memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include "racey-common.h"
+#include "racey-marker.h"
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <linux/sched.h>  /* struct clone_args */
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/syscall.h>
 
+extern char** environ;
+
 int MaxLoop = 50000;
+int Reps = 1;
 #define MAX_ELEM 64
 #define PAGE_SIZE (1 << 10)
 
@@ -44,14 +60,131 @@ int MaxLoop = 50000;
 #define RD 0
 #define WR 1
 
-int  NumProcs;
-int  inputs[33][2];
-int  output[33][2];
+/*
+ * A message is MsgSize/4 ints, 16 by default.  Up to PIPE_BUF bytes a
+ * write is atomic; larger messages may interleave with other writers'.
+ * A batch of several messages must fit in PIPE_BUF.
+ */
+int  MsgSize = 64;
+int  MsgInts;
+
+int  NumProcs;        /* writers, and input pipes */
+int  NumReaders;      /* one per pipe, or --readers with epoll */
+int  NumThreads;      /* processes: NumProcs + NumReaders */
+int  (*inputs)[2];   /* NumProcs+1 pipes, indexed by thread id */
+int  (*output)[2];   /* indexed by reader id */
+
+/* How writers hand messages to the kernel */
+enum { TRANSPORT_WRITE, TRANSPORT_WRITEV, TRANSPORT_VMSPLICE };
+const char* Transport = "write";
+int  TransportKind;
+int  Batch = 1;      /* messages per write syscall, per target */
+int  PipeSize = 0;   /* F_SETPIPE_SZ for the input pipes, 0 = kernel default */
+int  PipeCapacity;   /* what the kernel gave us (F_GETPIPE_SZ) */
+long PageBytes;
+
+/* How readers wait for messages */
+enum { READER_BLOCK, READER_EPOLL };
+const char* Reader = "block";
+int  ReaderKind;
+#define MAX_EVENTS 64
+
+/* Which readers each writer may send to */
+enum { TOPO_ALL, TOPO_RING, TOPO_STAR, TOPO_FANOUT, TOPO_TREE, TOPO_CHAIN };
+const char* Topology = "all";
+int  TopologyKind;
+int  Fanout = 2;      /* children per node with --topology=tree */
+
+/*
+ * How the parent starts the readers and writers.  fork and clone3 run
+ * the child's code in a copy of the parent; vfork and posix_spawn exec
+ * this program again, which finds its role in CHILD_ENV and inherits
+ * only its own pipe ends and the shared memory.
+ */
+enum { SPAWN_FORK, SPAWN_CLONE3, SPAWN_VFORK, SPAWN_POSIX };
+const char* Spawn = "fork";
+int  SpawnKind;
+#define CHILD_ENV "RACEY_FORKPIPE_CHILD"
+char** SpawnArgv;     /* argv before option parsing, for exec */
+char** SpawnEnv;      /* environ, with CHILD_ENV first */
+char   ChildEnv[128];
+double SpawnStart;    /* when the parent started the first child */
+double SpawnSecs;     /* how long it took to start them all */
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "topology", RACEY_STR, &Topology, "all|ring|star|fanout|tree|chain: who writes to whom" },
+  { "fanout", RACEY_INT, &Fanout, "children per node with --topology=tree" },
+  { "msg-size", RACEY_INT, &MsgSize, "message size in bytes, a multiple of 4" },
+  { "transport", RACEY_STR, &Transport, "write|writev|vmsplice: how writers send" },
+  { "batch", RACEY_INT, &Batch, "messages per write syscall, per target" },
+  { "pipe-size", RACEY_INT, &PipeSize, "input pipe capacity in bytes (F_SETPIPE_SZ)" },
+  { "reader", RACEY_STR, &Reader, "block|epoll: one blocking reader per pipe, or epoll" },
+  { "readers", RACEY_INT, &NumReaders, "epoll readers, sharing the pipes (default 1)" },
+  { "spawn", RACEY_STR, &Spawn, "fork|clone3|vfork|posix_spawn: how children start" },
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* shared variables */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
+char*    sigSlots;  /* SIG(i), one cache line per thread */
+#define  SIG(i)   RACEY_SLOT(sigSlots, i, unsigned)
+
+/* Per-process counters, in shared memory, indexed like the phases */
+struct PipeStats {
+  long writes;       /* write/writev/vmsplice calls */
+  long reads;        /* read calls */
+  long waits;        /* epoll_wait calls */
+  long bytes;        /* bytes received */
+  double first;      /* readers: when the first message arrived */
+};
+char*    statSlots;
+#define  STATS(i) RACEY_SLOT(statSlots, i, struct PipeStats)
+
+/* Per input pipe, in shared memory: what went through it, and its depth */
+struct QueueStats {
+  long bytes;
+  long reads;
+  long samples;      /* FIONREAD samples, one per DEPTH_EVERY reads */
+  long depth;        /* sum of the queued bytes seen */
+  long maxDepth;
+};
+char*    queueSlots;
+#define  QUEUE(i) RACEY_SLOT(queueSlots, i, struct QueueStats)
+#define  DEPTH_EVERY 16
+
+/*
+ * A writer's unsent messages for one target, in page-aligned buffers of
+ * whole pages.  vmsplice hands the pages themselves to the pipe, so a
+ * buffer may only be refilled once the reader has consumed it: each
+ * target gets a ring of one buffer more than its pipe has page slots.
+ * The other transports copy, and use a single buffer.
+ */
+struct Pending {
+  char* bufs;
+  int   buf;         /* buffer being filled */
+  int   count;       /* messages in it */
+};
+int  RingBufs;
+long BufBytes;
+
+/*
+ * Phase and pin slots.  Blocking readers interleave with the writers,
+ * reader i in slot 2i-1 and writer i in slot 2i; with --reader=epoll the
+ * writers take slots 1..NumProcs and the readers follow.  Pipe i is read
+ * by reader OWNER(i).
+ */
+#define OWNER(i) (((i) - 1) % NumReaders + 1)
+
+int ReaderSlot(int id)
+{
+  return ReaderKind == READER_EPOLL ? NumProcs + id : 2*id - 1;
+}
+
+int WriterSlot(int id)
+{
+  return ReaderKind == READER_EPOLL ? id : 2*id;
+}
 
 
 /* the mix function */
@@ -59,28 +192,290 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
+/* The reader writer w sends its next message to, given num */
+int Target(int w, unsigned num)
+{
+  switch (TopologyKind) {
+  case TOPO_RING:               /* to the next writer's reader */
+    return w % NumProcs + 1;
+  case TOPO_STAR:               /* everyone to reader 1 */
+    return 1;
+  case TOPO_TREE:               /* to the parent, the root to itself */
+    return w == 1 ? 1 : (w - 2) / Fanout + 1;
+  case TOPO_CHAIN:              /* to the next stage, the last to itself */
+    return w < NumProcs ? w + 1 : NumProcs;
+  default:                      /* all, and fanout from writer 1: by signature */
+    return num % NumProcs + 1;
+  }
+}
+
+/* Messages writer w sends: with --topology=fanout only writer 1 sends */
+int WriterLoops(int w)
+{
+  return TopologyKind == TOPO_FANOUT && w != 1 ? 0 : MaxLoop;
+}
+
+/* Every DEPTH_EVERY-th read from pipe i, note the bytes queued in it */
+void SampleDepth(int i)
+{
+  int queued;
+  if (QUEUE(i).reads++ % DEPTH_EVERY != 0 ||
+      ioctl(inputs[i][RD], FIONREAD, &queued) < 0)
+    return;
+  QUEUE(i).samples++;
+  QUEUE(i).depth += queued;
+  if (queued > QUEUE(i).maxDepth)
+    QUEUE(i).maxDepth = queued;
+}
+
+/*
+ * The pipe ends, all O_CLOEXEC, sit in four blocks of descriptors from
+ * PipeBase: the input write ends, the input read ends (each reader's
+ * together), the output write ends and the output read ends.  A child
+ * then drops the ends it does not use with a few close_range() calls,
+ * rather than a close() each, and an exec'd child finds its ends from
+ * PipeBase alone.
+ */
+int  PipeBase, PipeEnd;
+
+void SetPipeFds()
+{
+  int i, r, pos = 0;
+  for (r = 1; r <= NumReaders; r++)
+    for (i = r; i <= NumProcs; i += NumReaders)
+      inputs[i][RD] = PipeBase + NumProcs + pos++;
+  for (i = 1; i <= NumProcs; i++) {
+    inputs[i][WR] = PipeBase + i - 1;
+    output[i][WR] = PipeBase + 2*NumProcs + i - 1;
+    output[i][RD] = PipeBase + 3*NumProcs + i - 1;
+  }
+  PipeEnd = PipeBase + 4*NumProcs;
+}
+
+/* close() first..last, in one syscall where the kernel has close_range() */
+void CloseRange(int first, int last)
+{
+  if (first > last)
+    return;
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, first, last, 0) == 0)
+    return;
+#endif
+  for (; first <= last; first++)
+    close(first);
+}
+
+/* The block of input pipe ends a reader reads, or a writer writes */
+void InputRange(int reader, int id, int* lo, int* hi)
+{
+  if (reader) {
+    *lo = inputs[id][RD];
+    *hi = inputs[id + (NumProcs - id) / NumReaders * NumReaders][RD];
+  } else {
+    *lo = inputs[1][WR];
+    *hi = inputs[NumProcs][WR];
+  }
+}
+
+/* In a child: close the pipe ends it does not use */
+void DropPipes(int reader, int id)
+{
+  int lo, hi;
+  InputRange(reader, id, &lo, &hi);
+  CloseRange(PipeBase, lo - 1);
+  if (reader) {
+    CloseRange(hi + 1, output[id][WR] - 1);
+    CloseRange(output[id][WR] + 1, PipeEnd - 1);
+  } else {
+    CloseRange(hi + 1, PipeEnd - 1);
+  }
+}
+
+/* Open the reader input and output pipes */
+int OpenPipes()
+{
+  int (*in)[2] = calloc(NumProcs + 1, sizeof(*in));
+  int (*out)[2] = calloc(NumProcs + 1, sizeof(*out));
+  int i, j, fd;
+
+  PipeBase = 0;
+  for(i=1; i <= NumProcs; i++) {
+    if (pipe2(in[i], O_CLOEXEC) < 0 || pipe2(out[i], O_CLOEXEC) < 0) {
+      perror("pipe");
+      return -1;
+    }
+    if (PipeSize > 0 && fcntl(in[i][WR], F_SETPIPE_SZ, PipeSize) < 0) {
+      perror("F_SETPIPE_SZ");
+      return -1;
+    }
+    PipeCapacity = fcntl(in[i][WR], F_GETPIPE_SZ);
+    for (j = 0; j < 2; j++) {
+      if (in[i][j] >= PipeBase)
+        PipeBase = in[i][j] + 1;
+      if (out[i][j] >= PipeBase)
+        PipeBase = out[i][j] + 1;
+    }
+  }
+
+  /* move them above anything open, into their blocks */
+  for (fd = PipeBase; fd < PipeBase + 4*NumProcs; fd++)
+    if (fcntl(fd, F_GETFD) >= 0)
+      PipeBase = fd + 1;
+  SetPipeFds();
+  for(i=1; i <= NumProcs; i++) {
+    for (j = 0; j < 2; j++) {
+      if (dup3(in[i][j], inputs[i][j], O_CLOEXEC) < 0 ||
+          dup3(out[i][j], output[i][j], O_CLOEXEC) < 0) {
+        perror("dup3");
+        return -1;
+      }
+      close(in[i][j]);
+      close(out[i][j]);
+    }
+  }
+  free(in);
+  free(out);
+  return 0;
+}
+
+/* Fork server: the child owns the current pipes, open new ones for the next run */
+void ReopenPipes()
+{
+  CloseRange(PipeBase, PipeEnd - 1);
+  if (OpenPipes() < 0)
+    exit(1);
+}
+
+/*
+ * The phases, stats and queue slots share one MAP_SHARED mapping of a
+ * memfd, which the exec'd children map again: pass fd -1 to create it.
+ */
+int  ShmFd;
+
+void MapShared(int fd)
+{
+  const size_t threadBytes = (size_t)(NumThreads + 1) * RACEY_CACHE_LINE;
+  const size_t size = 2 * threadBytes + (size_t)(NumProcs + 1) * RACEY_CACHE_LINE;
+  char* p;
+
+  if (fd < 0) {
+    fd = memfd_create("racey-forkpipe", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+      perror("memfd_create");
+      exit(1);
+    }
+  }
+  p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  ShmFd = fd;
+  RaceyPhases = p;
+  statSlots = p + threadBytes;
+  queueSlots = p + 2 * threadBytes;
+}
+
+/*
+ * --reader=epoll: wait for any of this reader's pipes, and drain each
+ * ready one with nonblocking reads, so data is mixed in readiness order.
+ * Returns when every pipe has hit end of file.
+ */
+unsigned EpollRead(int threadId, unsigned num, long* reads)
+{
+  const int slot = ReaderSlot(threadId);
+  struct epoll_event events[MAX_EVENTS];
+  const int size = 2 * Batch * MsgSize;
+  char* buffer = malloc(size);
+  int* numbers = (int*)buffer;
+  int ep, open = 0, i, n, e, k, r;
+
+  ep = epoll_create1(0);
+  if (ep < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  for (i = threadId; i <= NumProcs; i += NumReaders) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+    fcntl(inputs[i][RD], F_SETFL, O_NONBLOCK);
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, inputs[i][RD], &ev) < 0) {
+      perror("epoll_ctl");
+      exit(1);
+    }
+    open++;
+  }
+
+  while (open > 0) {
+    n = epoll_wait(ep, events, MAX_EVENTS, -1);
+    STATS(slot).waits++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (e = 0; e < n; e++) {
+      const int in = events[e].data.u32;
+      const int fd = inputs[in][RD];
+      do {
+        SampleDepth(in);
+        RACEY_MARK_BEGIN();
+        r = read(fd, buffer, size);
+        RACEY_MARK_END();
+        (*reads)++;
+        if (r < 0)
+          break;
+        if (r > 0 && STATS(slot).first == 0)
+          STATS(slot).first = RaceyNow();
+        num = mix(num, r);
+        for (k = 0; k < r / sizeof(*numbers); k++)
+          num = mix(num, numbers[k]);
+        STATS(slot).bytes += r;
+        QUEUE(in).bytes += r;
+      } while (r > 0);
+      if (r < 0 && errno != EAGAIN) {
+        perror("read");
+        exit(1);
+      }
+      if (r == 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        open--;
+      }
+    }
+  }
+  close(ep);
+  free(buffer);
+  return num;
+}
+
 void ReaderProcess(int threadId)
 {
-  char buffer[128];
+  const int slot = ReaderSlot(threadId);
+  const int size = 2 * Batch * MsgSize;  /* 128 bytes, as before, by default */
+  char* buffer = malloc(size);
   int* numbers = (int*)buffer;
-  int num = sig[threadId];
+  int num = SIG(threadId);
+  long reads = 0;
   int i, k, r;
 
   /* close unused pipes */
-  for (i=1; i <= NumProcs; ++i) {
-    if (i == threadId) {
-      close(inputs[i][WR]);
-      close(output[i][RD]);
-    } else {
-      close(inputs[i][RD]);
-      close(inputs[i][WR]);
-      close(output[i][RD]);
-      close(output[i][WR]);
-    }
-  }
+  DropPipes(1, threadId);
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for (i=0; i<0x07ffffff; i++) {};
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(slot - 1);
+  RaceyWarmup();
+
+  RaceyPhaseBegin(slot);
+
+  if (ReaderKind == READER_EPOLL) {
+    num = EpollRead(threadId, num, &reads);
+    RaceyPhaseEnd(slot, reads);
+    STATS(slot).reads = reads;
+    write(output[threadId][WR], &num, sizeof(num));
+    close(output[threadId][WR]);
+    return;
+  }
 
   /*
    * main loop:
@@ -88,16 +483,23 @@ void ReaderProcess(int threadId)
    * If mix() is good, any race (except read-read, which can tell by software)
    * should change the final value of mix
    */
-  for (r = 1; r > 0; ) {
-    syscall(318);
-    r = read(inputs[threadId][RD], buffer, sizeof buffer);
-    syscall(319);
+  for (i = 0, r = 1; r > 0; i++) {
+    SampleDepth(threadId);
+    RACEY_MARK_BEGIN();
+    r = read(inputs[threadId][RD], buffer, size);
+    RACEY_MARK_END();
     num = mix(num, r);
     if (r > 0) {
+      if (i == 0)
+        STATS(slot).first = RaceyNow();
       for (k = 0; k < r / sizeof(*numbers); k++)
         num = mix(num, numbers[k]);
+      STATS(slot).bytes += r;
+      QUEUE(threadId).bytes += r;
     }
   }
+  RaceyPhaseEnd(slot, i);
+  STATS(slot).reads = i;
 
   /* return */
   write(output[threadId][WR], &num, sizeof(num));
@@ -105,20 +507,74 @@ void ReaderProcess(int threadId)
   close(output[threadId][WR]);
 }
 
+/* Send the pending messages of p to fd in one syscall */
+int SendPending(int fd, struct Pending* p)
+{
+  char* buf = p->bufs + (size_t)p->buf * BufBytes;
+  struct iovec iov[PIPE_BUF / sizeof(int)];
+  int k, r;
+
+  RACEY_MARK_BEGIN();
+  switch (TransportKind) {
+  case TRANSPORT_WRITEV:
+    for (k = 0; k < p->count; k++) {
+      iov[k].iov_base = buf + k * MsgSize;
+      iov[k].iov_len = MsgSize;
+    }
+    r = writev(fd, iov, p->count);
+    break;
+  case TRANSPORT_VMSPLICE:
+    /* past a page, vmsplice() may move part of it: go on with the rest */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = p->count * MsgSize;
+    for (r = 0; iov[0].iov_len > 0; r += k) {
+      k = vmsplice(fd, iov, 1, 0);
+      if (k < 0) {
+        r = k;
+        break;
+      }
+      iov[0].iov_base = (char*)iov[0].iov_base + k;
+      iov[0].iov_len -= k;
+    }
+    p->buf = (p->buf + 1) % RingBufs;
+    break;
+  default:
+    r = write(fd, buf, p->count * MsgSize);
+  }
+  RACEY_MARK_END();
+  p->count = 0;
+  return r;
+}
+
 void WriterProcess(int threadId)
 {
-  int buffer[16];
-  int num = sig[threadId];
+  const int slot = WriterSlot(threadId);
+  const int loops = WriterLoops(threadId);
+  int* buffer = malloc(MsgSize);
+  int num = SIG(threadId);
   int i, k, r;
+  struct Pending* pending;
+  char* bufs;
 
   /* close unused pipes */
-  for (i=1; i <= NumProcs; ++i) {
-    close(output[i][RD]);
-    close(output[i][WR]);
+  DropPipes(0, threadId);
+
+  /* page-aligned send buffers, RingBufs per target */
+  pending = calloc(NumProcs + 1, sizeof(*pending));
+  bufs = mmap(NULL, (size_t)(NumProcs + 1) * RingBufs * BufBytes,
+              PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (pending == NULL || buffer == NULL || bufs == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
   }
+  for (i=1; i <= NumProcs; ++i)
+    pending[i].bufs = bufs + (size_t)i * RingBufs * BufBytes;
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(slot - 1);
+  RaceyWarmup();
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for (i=0; i<0x07ffffff; i++) {};
+  RaceyPhaseBegin(slot);
 
   /*
    * main loop:
@@ -126,125 +582,392 @@ void WriterProcess(int threadId)
    * If mix() is good, any race (except read-read, which can tell by software)
    * should change the final value of mix
    */
-  for (i = 0; i < MaxLoop; ++i) {
-    for (k = 0; k < sizeof(buffer)/sizeof(*buffer); ++k) {
+  for (i = 0; i < loops; ++i) {
+    for (k = 0; k < MsgInts; ++k) {
       num = mix(num, k * PRIME1);
       num = mix(num, PRIME2 / (k+1));
       buffer[k] = num;
     }
-    const int target = (num % NumProcs) + 1;
-    syscall(318);
-    r = write(inputs[target][WR], buffer, sizeof buffer);
-    syscall(319);
+    const int target = Target(threadId, num);
+    struct Pending* p = &pending[target];
+    memcpy(p->bufs + (size_t)p->buf * BufBytes + p->count * MsgSize,
+           buffer, MsgSize);
+    if (++p->count < Batch)
+      continue;
+    r = SendPending(inputs[target][WR], p);
     num = mix(num, r);
+    STATS(slot).writes++;
   }
 
-  /* close unused pipes */
-  for (i=1; i <= NumProcs; ++i) {
-    close(inputs[i][RD]);
-    close(inputs[i][WR]);
+  /* flush the partial batches */
+  for (k = 1; k <= NumProcs; ++k) {
+    if (pending[k].count == 0)
+      continue;
+    r = SendPending(inputs[k][WR], &pending[k]);
+    num = mix(num, r);
+    STATS(slot).writes++;
+  }
+  RaceyPhaseEnd(slot, loops);
+
+  /* close the pipes, so the readers see end of file */
+  CloseRange(inputs[1][WR], inputs[NumProcs][WR]);
+}
+
+/* Run reader or writer 'id' in this process */
+void RunChild(int reader, int id)
+{
+  if (reader)
+    ReaderProcess(id);
+  else
+    WriterProcess(id);
+}
+
+/*
+ * Start reader or writer 'id' as --spawn says.  Returns its pid, or 0 in
+ * a fork()ed or clone3()d child, which then runs it.  An exec'd child
+ * inherits just its pipe ends and the shared memory, and starts over in
+ * main(), which hands it to ExecChild().
+ */
+pid_t StartChild(int reader, int id)
+{
+  posix_spawn_file_actions_t actions;
+  int lo, hi, fd, r;
+  pid_t pid;
+
+  if (SpawnKind == SPAWN_FORK)
+    return fork();
+  if (SpawnKind == SPAWN_CLONE3) {
+#ifdef SYS_clone3
+    struct clone_args args;
+    memset(&args, 0, sizeof args);
+    args.exit_signal = SIGCHLD;
+    return syscall(SYS_clone3, &args, sizeof args);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
   }
+
+  InputRange(reader, id, &lo, &hi);
+  snprintf(ChildEnv, sizeof ChildEnv, CHILD_ENV "=%d %d %d %d %d",
+           reader, id, PipeBase, ShmFd, RaceyWarmupIters);
+  if (SpawnKind == SPAWN_VFORK) {
+    pid = vfork();
+    if (pid == 0) {
+      /* our own copy of the descriptor table: let the ends through exec */
+      for (fd = lo; fd <= hi; fd++)
+        fcntl(fd, F_SETFD, 0);
+      if (reader)
+        fcntl(output[id][WR], F_SETFD, 0);
+      fcntl(ShmFd, F_SETFD, 0);
+      execve("/proc/self/exe", SpawnArgv, SpawnEnv);
+      _exit(127);
+    }
+    return pid;
+  }
+
+  /* dup2() onto itself clears FD_CLOEXEC */
+  posix_spawn_file_actions_init(&actions);
+  for (fd = lo; fd <= hi; fd++)
+    posix_spawn_file_actions_adddup2(&actions, fd, fd);
+  if (reader)
+    posix_spawn_file_actions_adddup2(&actions, output[id][WR], output[id][WR]);
+  posix_spawn_file_actions_adddup2(&actions, ShmFd, ShmFd);
+  r = posix_spawn(&pid, "/proc/self/exe", &actions, NULL, SpawnArgv, SpawnEnv);
+  posix_spawn_file_actions_destroy(&actions);
+  if (r != 0) {
+    errno = r;
+    return -1;
+  }
+  return pid;
+}
+
+/* An exec'd child: find the parent's pipes and shared memory, and run */
+int ExecChild(const char* env)
+{
+  int reader, id;
+
+  if (sscanf(env, "%d %d %d %d %d", &reader, &id, &PipeBase, &ShmFd,
+             &RaceyWarmupIters) != 5) {
+    fprintf(stderr, "bad " CHILD_ENV "=%s\n", env);
+    return 1;
+  }
+  SetPipeFds();
+  MapShared(ShmFd);
+  if (!reader) {
+    PipeCapacity = fcntl(inputs[1][WR], F_GETPIPE_SZ);
+    RingBufs = TransportKind == TRANSPORT_VMSPLICE ? PipeCapacity / PageBytes + 1 : 1;
+  }
+  RunChild(reader, id);
+  return 0;
+}
+
+void PrintPipeMetrics(double secs)
+{
+  struct PipeStats total = { 0 };
+  double first = 0;
+  long messages;
+  int i;
+
+  printf(", \"topology\": \"%s\", \"msg_size\": %d", Topology, MsgSize);
+  if (TopologyKind == TOPO_TREE)
+    printf(", \"fanout\": %d", Fanout);
+
+  for (i = 1; i <= NumThreads; i++) {
+    total.writes += STATS(i).writes;
+    total.reads += STATS(i).reads;
+    total.waits += STATS(i).waits;
+    total.bytes += STATS(i).bytes;
+    if (STATS(i).first > 0 && (first == 0 || STATS(i).first < first))
+      first = STATS(i).first;
+  }
+  messages = total.bytes / MsgSize;
+  printf(", \"transport\": \"%s\", \"batch\": %d, \"pipe_size\": %d, "
+         "\"messages\": %ld, \"messages_per_sec\": %.0f, "
+         "\"bytes_per_sec\": %.0f, \"write_syscalls\": %ld, "
+         "\"reader\": \"%s\", \"readers\": %d, "
+         "\"read_syscalls\": %ld, \"epoll_waits\": %ld, "
+         "\"syscalls_per_message\": %.3f",
+         Transport, Batch, PipeCapacity, messages,
+         secs > 0 ? messages / secs : 0.0, secs > 0 ? total.bytes / secs : 0.0,
+         total.writes, Reader, NumReaders, total.reads, total.waits,
+         messages > 0 ? (double)(total.writes + total.reads + total.waits) / messages : 0.0);
+  printf(", \"spawn\": \"%s\", \"spawn_secs\": %.6f, \"first_message_secs\": %.6f",
+         Spawn, SpawnSecs, first > 0 ? first - SpawnStart : 0.0);
+
+  /* per input pipe, depths in messages */
+  printf(", \"queues\": [");
+  for (i = 1; i <= NumProcs; i++) {
+    struct QueueStats* q = &QUEUE(i);
+    printf("%s{\"pipe\": %d, \"messages\": %ld, \"depth_mean\": %.2f, "
+           "\"depth_max\": %.2f}", i > 1 ? ", " : "", i, q->bytes / MsgSize,
+           q->samples > 0 ? (double)q->depth / q->samples / MsgSize : 0.0,
+           (double)q->maxDepth / MsgSize);
+  }
+  printf("]");
+  memset(statSlots, 0, (size_t)(NumThreads + 1) * RACEY_CACHE_LINE);
+  memset(queueSlots, 0, (size_t)(NumProcs + 1) * RACEY_CACHE_LINE);
 }
 
 int
 main(int argc, char* argv[])
 {
-  int  mix_sig, i, k, r;
+  int  mix_sig, i, k, r, last, rep;
   int* pids;
 
-  /* Parse arguments */
+  /*
+   * Parse arguments, keeping them for an exec'd child.  An exec'd child
+   * gets the parent's warm-up count in CHILD_ENV, so --warmup=MS must
+   * not calibrate again in every child.
+   */
+  SpawnArgv = calloc(argc + 1, sizeof(*SpawnArgv));
+  memcpy(SpawnArgv, argv, argc * sizeof(*argv));
+  RaceyWarmupInherited = getenv(CHILD_ENV) != NULL;
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
+  assert(Reps > 0);
+  if (strcmp(Transport, "write") == 0)
+    TransportKind = TRANSPORT_WRITE;
+  else if (strcmp(Transport, "writev") == 0)
+    TransportKind = TRANSPORT_WRITEV;
+  else if (strcmp(Transport, "vmsplice") == 0)
+    TransportKind = TRANSPORT_VMSPLICE;
+  else {
+    fprintf(stderr, "unknown --transport=%s\n", Transport);
+    exit(1);
+  }
+  if (MsgSize < (int)sizeof(int) || MsgSize % sizeof(int) != 0) {
+    fprintf(stderr, "--msg-size=%d: want a multiple of %d\n", MsgSize, (int)sizeof(int));
+    exit(1);
+  }
+  MsgInts = MsgSize / sizeof(int);
+  if (Batch < 1 || (Batch > 1 && Batch * MsgSize > PIPE_BUF)) {
+    fprintf(stderr, "--batch=%d: want 1, or up to %d messages of %d bytes\n",
+            Batch, PIPE_BUF / MsgSize, MsgSize);
+    exit(1);
+  }
+  PageBytes = sysconf(_SC_PAGESIZE);
+  BufBytes = ((long)Batch * MsgSize + PageBytes - 1) / PageBytes * PageBytes;
+  if (strcmp(Topology, "all") == 0)
+    TopologyKind = TOPO_ALL;
+  else if (strcmp(Topology, "ring") == 0)
+    TopologyKind = TOPO_RING;
+  else if (strcmp(Topology, "star") == 0)
+    TopologyKind = TOPO_STAR;
+  else if (strcmp(Topology, "fanout") == 0)
+    TopologyKind = TOPO_FANOUT;
+  else if (strcmp(Topology, "tree") == 0)
+    TopologyKind = TOPO_TREE;
+  else if (strcmp(Topology, "chain") == 0)
+    TopologyKind = TOPO_CHAIN;
+  else {
+    fprintf(stderr, "unknown --topology=%s\n", Topology);
+    exit(1);
+  }
+  if (Fanout < 1) {
+    fprintf(stderr, "--fanout=%d: want at least 1\n", Fanout);
+    exit(1);
+  }
+  if (strcmp(Reader, "block") == 0)
+    ReaderKind = READER_BLOCK;
+  else if (strcmp(Reader, "epoll") == 0)
+    ReaderKind = READER_EPOLL;
+  else {
+    fprintf(stderr, "unknown --reader=%s\n", Reader);
+    exit(1);
+  }
+  if (ReaderKind == READER_BLOCK && NumReaders != 0 && NumReaders != NumProcs) {
+    fprintf(stderr, "--readers=%d needs --reader=epoll\n", NumReaders);
+    exit(1);
+  }
+  if (NumReaders == 0)
+    NumReaders = ReaderKind == READER_EPOLL ? 1 : NumProcs;
+  if (NumReaders < 1 || NumReaders > NumProcs) {
+    fprintf(stderr, "--readers=%d: want 1 to %d\n", NumReaders, NumProcs);
+    exit(1);
+  }
+  NumThreads = NumProcs + NumReaders;
+  if (strcmp(Spawn, "fork") == 0)
+    SpawnKind = SPAWN_FORK;
+  else if (strcmp(Spawn, "clone3") == 0)
+    SpawnKind = SPAWN_CLONE3;
+  else if (strcmp(Spawn, "vfork") == 0)
+    SpawnKind = SPAWN_VFORK;
+  else if (strcmp(Spawn, "posix_spawn") == 0)
+    SpawnKind = SPAWN_POSIX;
+  else {
+    fprintf(stderr, "unknown --spawn=%s\n", Spawn);
+    exit(1);
+  }
 
-  pids = calloc(sizeof(int), NumProcs*2);
+  pids = calloc(sizeof(int), NumThreads);
 
-  /* Open pipes */
-  for(i=1; i <= NumProcs; i++) {
-    r = pipe(inputs[i]);
-    if (r < 0) {
-      perror("pipe");
-      return 1;
-    }
-    r = pipe(output[i]);
-    if (r < 0) {
-      perror("pipe");
-      return 1;
-    }
+  /* Initialize sig[] */
+  sigSlots = RaceyAllocSlots(NumProcs + 1);
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+
+  inputs = calloc(NumProcs + 1, sizeof(*inputs));
+  output = calloc(NumProcs + 1, sizeof(*output));
+  if (getenv(CHILD_ENV) != NULL)
+    return ExecChild(getenv(CHILD_ENV));
+
+  MapShared(-1);
+
+  /* exec'd children get our environment, with their role in front */
+  if (SpawnKind == SPAWN_VFORK || SpawnKind == SPAWN_POSIX) {
+    for (i = 0; environ[i] != NULL; i++)
+      ;
+    SpawnEnv = calloc(i + 2, sizeof(*SpawnEnv));
+    SpawnEnv[0] = ChildEnv;
+    memcpy(SpawnEnv + 1, environ, i * sizeof(*environ));
   }
 
-  /* Spawn threads */
-  for(i=1; i <= NumProcs*2; i++) {
-    r = fork();
-    if (r < 0) {
-      perror("fork");
-      return 1;
+  /* four fds per thread */
+  RaceyRaiseFdLimit();
+
+  /* Open pipes */
+  if (OpenPipes() < 0)
+    return 1;
+  RingBufs = TransportKind == TRANSPORT_VMSPLICE ? PipeCapacity / PageBytes + 1 : 1;
+
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyMetricsExtra = PrintPipeMetrics;
+  RaceyForkServer(ReopenPipes, NULL);
+
+  for(rep = 0; rep < Reps; rep++) {
+    /*
+     * The last phase closed its pipes: open new ones, as the fork server
+     * does.  The cpus are already seized, so later children skip the
+     * warm-up, like the threads that live across phases elsewhere.
+     */
+    if (rep > 0) {
+      ReopenPipes();
+      RaceyWarmupIters = 0;
     }
-    if (r == 0) {
-      if (i%2 == 1)
-        ReaderProcess((i+1)/2);
-      else
-        WriterProcess((i+1)/2);
-      return 0;
+
+    /* Spawn threads */
+    SpawnStart = RaceyNow();
+    for(i=1; i <= NumThreads; i++) {
+      /* the inverse of ReaderSlot() and WriterSlot() */
+      const int epoll = ReaderKind == READER_EPOLL;
+      const int reader = epoll ? i > NumProcs : i%2 == 1;
+      const int id = epoll ? (reader ? i - NumProcs : i) : (i+1)/2;
+      r = StartChild(reader, id);
+      if (r < 0) {
+        perror(Spawn);
+        return 1;
+      }
+      if (r == 0) {
+        RunChild(reader, id);
+        return 0;
+      }
+      pids[i-1] = r;
     }
-    pids[i-1] = r;
-  }
+    SpawnSecs = RaceyNow() - SpawnStart;
 
-  /* close unused pipes */
-  for (i=1; i <= NumProcs; ++i) {
-    close(inputs[i][RD]);
-    close(inputs[i][WR]);
-    close(output[i][WR]);
-  }
+    /* close unused pipes: the input blocks and the output write ends */
+    CloseRange(PipeBase, output[NumProcs][WR]);
 
-  /* Compute the result */
-  mix_sig = sig[0];
+    /* Compute the result */
+    mix_sig = SIG(0);
 
-  for(i=1; i <= NumProcs*2; i++) {
-    r = wait(NULL);
-    for (k=0; k < NumProcs*2; k++) {
-      if (pids[k] == r) {
-        printf("R: %d\n", k);
+    for(i=1; i <= NumThreads; i++) {
+      r = wait(NULL);
+      for (k=0; k < NumThreads; k++) {
+        if (pids[k] == r) {
+          printf("R: %d\n", k);
 //        mix_sig = mix(k, mix_sig);
-        break;
+          break;
+        }
       }
     }
-  }
 
-  for(i = 1; i < NumProcs ; i++) {
-    int num = 0;
-    r = read(output[i][RD], &num, sizeof(num));
-    if (r < 0) {
-      perror("read");
-      return 1;
-    }
-    if (r == 0) {
-      fprintf(stderr, "no output from thread %d\n", i);
-      return 1;
+    /*
+     * Blocking readers leave out the last reader's result, as they always
+     * have, so their signatures stay comparable; epoll readers mix them all.
+     */
+    last = ReaderKind == READER_EPOLL ? NumReaders : NumProcs - 1;
+    for(i = 1; i <= last ; i++) {
+      int num = 0;
+      r = read(output[i][RD], &num, sizeof(num));
+      if (r < 0) {
+        perror("read");
+        return 1;
+      }
+      if (r == 0) {
+        fprintf(stderr, "no output from thread %d\n", i);
+        return 1;
+      }
+      mix_sig = mix(num, mix_sig);
+      mix_sig = mix(r, mix_sig);
     }
-    mix_sig = mix(num, mix_sig);
-    mix_sig = mix(r, mix_sig);
-  }
 
-  /* end of parallel phase */
+    /* end of parallel phase */
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumThreads);
+    usleep(5);
+  }
 
   return 0;
 }
@@ -29,10 +29,12 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include "racey-common.h"
 #include <sys/mman.h>
 
 int MaxLoop = 50000;
-#define MAX_ELEM 64
+int Reps = 1;
+#define MAX_ELEM RaceyNumElems   /* --elems */
 #define PAGE_SIZE (1 << 10)
 
 #define PRIME1   103072243
@@ -41,16 +43,19 @@ int MaxLoop = 50000;
 int               NumProcs;
 volatile int      startCounter;
 pthread_mutex_t   threadLock;   /* counter mutex */
+pthread_barrier_t repBarrier;   /* main + threads, between repetitions */
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  RACEY_ELEM_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* shared variables */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
-union {
-  /* 64 bytes cache line */
-  char b[64];
-  int value;
-} m[MAX_ELEM];
+char*    sigSlots;  /* sig[i], laid out by --layout */
+#define  SIG(i)   RACEY_SIG(sigSlots, i)
+#define  M(i)     RACEY_ELEM(i)   /* m[i], see racey-common.h */
 
 
 /* the mix function */
@@ -58,14 +63,23 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
-/* The function which is called once the thread is created */
-void* ThreadBody(void* tid)
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
 {
-  int threadId = *(int *) tid;
   int i;
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  for(i = 0; i < MAX_ELEM; i++) {
+    M(i) = mix(i,i);
+  }
+  startCounter = NumProcs;
+}
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
+/* One parallel phase: barrier, then the main loop */
+void ParallelPhase(int threadId)
+{
+  int i;
 
   /* simple barrier, pass only once */
   pthread_mutex_lock(&threadLock);
@@ -76,6 +90,8 @@ void* ThreadBody(void* tid)
   pthread_mutex_unlock(&threadLock);
   while(startCounter) {};
 
+  RaceyPhaseBegin(threadId);
+
   /*
    * main loop:
    *
@@ -86,14 +102,14 @@ void* ThreadBody(void* tid)
    * should change the final value of mix
    */
   for(i = 0 ; i < MaxLoop; i++) {
-    unsigned num = sig[threadId];
+    unsigned num = SIG(threadId);
     unsigned index1 = num%MAX_ELEM;
     unsigned index2;
-    num = mix(num, m[index1].value);
+    num = mix(num, M(index1));
     index2 = num%MAX_ELEM;
-    num = mix(num, m[index2].value);
-    m[index2].value = num;
-    sig[threadId] = num;
+    num = mix(num, M(index2));
+    M(index2) = num;
+    SIG(threadId) = num;
     getuid();
     /* More syscalls: stress the VM subsystem */
     if (i % (MaxLoop/200) == 0) {
@@ -106,6 +122,27 @@ void* ThreadBody(void* tid)
       mprotect(x, 4096, PROT_NONE);
     }
   }
+  RaceyPhaseEnd(threadId, MaxLoop);
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  int threadId = *(int *) tid;
+  int rep;
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase(threadId);
+    /* let main() collect sig[] and reset the shared variables */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
   return NULL;
 }
 
@@ -116,27 +153,29 @@ main(int argc, char* argv[])
   int*           tids;
   pthread_attr_t attr;
   int            ret;
-  int            mix_sig, i;
+  int            mix_sig, i, rep;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
 
-  /* Initialize the mix array */
-  for(i = 0; i < MAX_ELEM; i++) {
-    m[i].value = mix(i,i);
-  }
+  assert(Reps > 0);
 
-  /* Initialize barrier counter */
-  startCounter = NumProcs;
+  /* Initialize the mix array, sig[] and the barrier counter */
+  RaceyAllocElems(0);
+  sigSlots = RaceyAllocSigs(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  InitShared();
 
   /* Initialize array of thread structures */
   threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
@@ -148,9 +187,15 @@ main(int argc, char* argv[])
   pthread_attr_init(&attr);
   pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
 
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
+
   ret = pthread_mutex_init(&threadLock, NULL);
   assert(ret == 0);
 
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyForkServer(NULL, NULL);
+
   for(i=0; i < NumProcs; i++) {
     /* ************************************************************
      * pthread_create takes 4 parameters
@@ -164,33 +209,48 @@ main(int argc, char* argv[])
     assert(ret == 0);
   }
 
-  /* Wait for each of the threads to terminate */
-  for(i=0; i < NumProcs; i++) {
-    ret = pthread_join(threads[i], NULL);
-    assert(ret == 0);
-  }
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
 
-  /* compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig[i], mix_sig);
-  }
+    /* compute the result */
+    mix_sig = SIG(0);
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
 
-  /* end of parallel phase */
+    /* end of parallel phase */
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
 
   pthread_mutex_destroy(&threadLock);
   pthread_attr_destroy(&attr);
+  pthread_barrier_destroy(&repBarrier);
 
   return 0;
 }
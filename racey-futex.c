@@ -29,6 +29,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include "racey-common.h"
 
 #include <linux/futex.h>
 #include <sys/syscall.h>
@@ -37,9 +40,17 @@
 static inline int futex(volatile int* uaddr, int op, int val) {
   return syscall(SYS_futex, uaddr, op, val, NULL /* no timeout */, NULL, 0);
 }
+static inline int futexBitset(volatile int* uaddr, int op, int val,
+                              unsigned bitset) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, bitset);
+}
 
 int MaxLoop = 50000;
-#define MAX_ELEM 64
+int Reps = 1;
+int SpinMax = 0;      /* --spin: max polls of the futex word before waiting */
+int NumGroups = 4;    /* --groups */
+const char* WakeMode = "all";   /* --wake */
+#define MAX_ELEM RaceyNumElems   /* --elems */
 #define PAGE_SIZE (1 << 10)
 
 #define PRIME1   103072243
@@ -47,92 +58,344 @@ int MaxLoop = 50000;
 
 int               NumProcs;
 pthread_barrier_t barrier;
+pthread_barrier_t repBarrier;    /* main + threads, between repetitions */
 __thread int      threadId;
 
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "spin", RACEY_INT, &SpinMax, "poll up to N times (adaptive) before FUTEX_WAIT" },
+  { "groups", RACEY_INT, &NumGroups, "scheduling groups the threads are split into" },
+  { "wake", RACEY_STR, &WakeMode, "who a new owner wakes: all, bitset or thread" },
+  RACEY_ELEM_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
+
 /* private variables (sig[i] private to thread i) */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
+char*    sigSlots;  /* sig[i], laid out by --layout */
+#define  SIG(i)   RACEY_SIG(sigSlots, i)
 
 /* futex groups */
-#define NFUTEX 4
+#define NFUTEX NumGroups     /* --groups */
+#define WORD_BITS (8 * (int)sizeof(unsigned long))
 struct FutexGroup {
-  volatile int owner;        // threadId, or -1 for "all"
+  volatile int owner;        // threadId, or -size for "all"
   volatile int round;        // scheduling round
-  volatile int threads[33];  // set to 1 if the thread is present
-  int begin, end;            // range of possibly live indexes in threads[]
-} groups[NFUTEX];
+  volatile int count;        // "all" round: threads yet to reach the barrier
+  volatile int sense;        // "all" round: flipped when the barrier opens
+  volatile int leader;       // "all" round: its lowest member, who schedules
+  volatile unsigned long* members;  // bit i set if thread i is present
+  int begin, end;            // range of possibly live bits in members[]
+} __attribute__((aligned(RACEY_CACHE_LINE)));
+struct FutexGroup* groups;   // NFUTEX of them, one per cache line
+int GroupWords;              // size of members[]: NumProcs + 2 bits
+
+/* per-thread counts for the metrics line, reset by InitShared() */
+struct FutexStats {
+  long waits;                // FUTEX_WAIT calls
+  long wakes;                // FUTEX_WAKE calls
+  long woken;                // threads those calls woke
+  long spinHits;             // waits that ended while polling
+};
+char*    statSlots;
+#define  STATS(i) RACEY_SLOT(statSlots, i, struct FutexStats)
+__thread int spinLimit;      // current adaptive poll budget, <= SpinMax
+
+/*
+ * --wake: who is woken when a thread hands the group to a new owner.
+ * all wakes every waiter on the owner word, and all but one go back to
+ * sleep.  bitset waits with FUTEX_WAIT_BITSET, one bit per thread (mod
+ * 32), and wakes only the bit of the new owner.  thread gives each
+ * thread a futex word of its own, bumped and woken only when the
+ * thread may run.  The barrier of an "all" round always wakes all.
+ */
+enum { WAKE_ALL, WAKE_BITSET, WAKE_THREAD } WakeKind;
+char*    turnSlots;          // --wake=thread: per-thread futex words
+#define  TURN(i)  RACEY_SLOT(turnSlots, i, volatile int)
+#define  THREAD_BIT(i) (1u << ((i) % 32))
 
 /* shared variables */
-union {
-  char b[64];   /* 64 bytes cache line */
-  int value;
-} m[MAX_ELEM];
+#define  M(i)     RACEY_ELEM(i)   /* m[i], see racey-common.h */
 
 /* the mix function */
 unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
-static int groupSize(struct FutexGroup* g) {
-  int i, n = 0;
-  for (i = 0; i < 33; ++i)
-    if (g->threads[i])
-      n++;
-  return n;
+static void futexWait(volatile int* uaddr, int val) {
+  STATS(threadId).waits++;
+  futex(uaddr, FUTEX_WAIT, val);
+}
+
+static void futexWake(volatile int* uaddr) {
+  STATS(threadId).wakes++;
+  STATS(threadId).woken += futex(uaddr, FUTEX_WAKE, INT_MAX);
 }
 
-static int groupLeader(struct FutexGroup* g) {
+static void futexWaitBits(volatile int* uaddr, int val, unsigned bits) {
+  STATS(threadId).waits++;
+  futexBitset(uaddr, FUTEX_WAIT_BITSET, val, bits);
+}
+
+static void futexWakeBits(volatile int* uaddr, unsigned bits) {
+  STATS(threadId).wakes++;
+  STATS(threadId).woken += futexBitset(uaddr, FUTEX_WAKE_BITSET, INT_MAX, bits);
+}
+
+/*
+ * Poll *uaddr while it is val, for up to the thread's --spin budget.
+ * The budget doubles (up to --spin) when polling succeeds and halves
+ * when the thread has to sleep anyway, so threads whose turn comes
+ * quickly skip the syscall and the others stop wasting their time
+ * slice.  Returns 1 if *uaddr changed.
+ */
+static int spinChange(volatile int* uaddr, int val) {
   int i;
-  for (i = 0; i < 33; ++i)
-    if (g->threads[i])
-      return i;
+  for (i = 0; i < spinLimit; ++i) {
+    if (*uaddr != val) {
+      STATS(threadId).spinHits++;
+      spinLimit = (spinLimit * 2 < SpinMax) ? spinLimit * 2 : SpinMax;
+      return 1;
+    }
+    RaceyPause();
+  }
+  if (spinLimit > 1)
+    spinLimit /= 2;
   return 0;
 }
 
+/* Wait until *uaddr is no longer val: poll (--spin), then FUTEX_WAIT */
+static void waitChange(volatile int* uaddr, int val) {
+  if (!spinChange(uaddr, val))
+    futexWait(uaddr, val);
+}
+
+static int groupSize(struct FutexGroup* g) {
+  int w, n = 0;
+  for (w = 0; w < GroupWords; ++w)
+    n += __builtin_popcountl(g->members[w]);
+  return n;
+}
+
 static void groupRemoveMe(struct FutexGroup* g) {
-  g->threads[threadId] = 0;
+  __sync_fetch_and_and(&g->members[threadId / WORD_BITS],
+                       ~(1UL << (threadId % WORD_BITS)));
+}
+
+/* the first member in [from, to), or to if there is none */
+static int groupNextMember(struct FutexGroup* g, int from, int to) {
+  int w = from / WORD_BITS;
+  unsigned long bits = g->members[w] & (~0UL << (from % WORD_BITS));
+  for (;;) {
+    if (bits) {
+      int n = w * WORD_BITS + __builtin_ctzl(bits);
+      return n < to ? n : to;
+    }
+    if (++w * WORD_BITS >= to)
+      return to;
+    bits = g->members[w];
+  }
 }
 
 static int groupPickNext(struct FutexGroup* g) {
   int n;
-  for (n = 0; n < 33; ++n) {
-    if (g->threads[n]) {
-      /* group is non-empty, so we can schedule */
-      n = sig[threadId] % (g->end - g->begin + 1) + g->begin;
-      while (n != g->end && g->threads[n] == 0)
-        n = (n+1) % 33;
-      /* n == end means schedule the whole group */
-      return (n == g->end) ? -groupSize(g) : n;
+  if (groupNextMember(g, g->begin, g->end) == g->end)
+    return 0;
+  /* group is non-empty, so we can schedule */
+  n = SIG(threadId) % (g->end - g->begin + 1) + g->begin;
+  n = groupNextMember(g, n, g->end);
+  /* n == end means schedule the whole group */
+  return (n == g->end) ? -groupSize(g) : n;
+}
+
+/*
+ * Hand the group to the next owner.  For an "all" round the barrier
+ * count is reset before the new owner is published, so no thread can
+ * arrive at the barrier before it is ready.  Its leader is fixed here,
+ * once, rather than by each thread as its turn starts: by then a member
+ * may have finished and left, and a second leader would appear.
+ */
+static void groupSchedule(struct FutexGroup* g) {
+  const int next = groupPickNext(g);
+  if (next < 0) {
+    g->count = -next;
+    g->leader = groupNextMember(g, g->begin, g->end);
+  }
+  g->round++;
+  __sync_synchronize();
+  g->owner = next;
+}
+
+/*
+ * Wait for the owner to move on from owner, which is not me.  Returns
+ * early (spuriously) if it cannot tell; the caller re-reads g->owner.
+ * With --wake=thread the word is re-checked after reading my turn word,
+ * so a wakeTurn() in between makes FUTEX_WAIT return at once.
+ */
+static void waitTurn(struct FutexGroup* g, int owner) {
+  int turn;
+  switch (WakeKind) {
+  case WAKE_ALL:
+    waitChange(&g->owner, owner);
+    break;
+  case WAKE_BITSET:
+    if (!spinChange(&g->owner, owner))
+      futexWaitBits(&g->owner, owner, THREAD_BIT(threadId));
+    break;
+  case WAKE_THREAD:
+    if (spinChange(&g->owner, owner))
+      break;
+    turn = TURN(threadId);
+    __sync_synchronize();
+    if (g->owner == owner)
+      futexWait(&TURN(threadId), turn);
+    break;
+  }
+}
+
+/* Wake the threads that the owner just published by groupSchedule() lets run */
+static void wakeTurn(struct FutexGroup* g) {
+  const int next = g->owner;
+  int n;
+  switch (WakeKind) {
+  case WAKE_ALL:
+    futexWake(&g->owner);
+    break;
+  case WAKE_BITSET:
+    if (next > 0)
+      futexWakeBits(&g->owner, THREAD_BIT(next));
+    else if (next < 0)
+      futexWakeBits(&g->owner, FUTEX_BITSET_MATCH_ANY);
+    break;
+  case WAKE_THREAD:
+    if (next > 0) {
+      __sync_fetch_and_add(&TURN(next), 1);
+      futexWake(&TURN(next));
+    } else if (next < 0) {
+      for (n = groupNextMember(g, g->begin, g->end); n != g->end;
+           n = groupNextMember(g, n + 1, g->end)) {
+        if (n == threadId)
+          continue;
+        __sync_fetch_and_add(&TURN(n), 1);
+        futexWake(&TURN(n));
+      }
     }
+    break;
   }
-  return 0;
 }
 
-/* The function which is called once the thread is created */
-void* ThreadBody(void* tid)
+/*
+ * Execution barrier at the end of an "all" round, sense-reversing: once
+ * everyone is in, the round's leader schedules the next round, with its
+ * own sig as it always has, and then flips the group's sense.  The
+ * leader waits for the count to drop to 0, and the others for the flip,
+ * polling first with --spin and then sleeping in FUTEX_WAIT, so an
+ * oversubscribed group does not burn the cpu its last arriver needs.
+ * *sense is the thread's own sense, which starts at 0 each phase, as
+ * g->sense does.  A thread that is leaving the group does not wait for
+ * the flip: later rounds do not count it, so the sense could flip back
+ * before it woke up.
+ */
+static void groupBarrier(struct FutexGroup* g, int* sense, int leaving) {
+  const int leader = g->leader == threadId;  /* before g->count lets it move */
+  int count;
+
+  *sense = !*sense;
+  count = __sync_sub_and_fetch(&g->count, 1);
+  if (leader) {
+    while ((count = g->count) != 0)
+      waitChange(&g->count, count);
+    groupSchedule(g);
+    __sync_synchronize();
+    g->sense = *sense;
+    futexWake(&g->sense);
+  } else {
+    if (count == 0)
+      futexWake(&g->count);
+    while (!leaving && g->sense != *sense)
+      waitChange(&g->sense, !*sense);
+  }
+}
+
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
 {
-  struct FutexGroup* g = NULL;
-  const int npersig =
-    MaxLoop >= 1000 ? MaxLoop / 1000 :
-    MaxLoop >= 100  ? MaxLoop / 100  : 1;
   int i, k;
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  for(i = 0; i < MAX_ELEM; i++) {
+    M(i) = mix(i,i);
+  }
 
-  threadId = *(int*) tid;
-  for(i=0; i<NFUTEX; ++i) {
-    g = groups + i;
-    if (g->threads[threadId])
-      break;
+  memset(statSlots, 0, (size_t)(NumProcs + 1) * RACEY_CACHE_LINE);
+
+  /* Initialize futex groups; the last group takes any leftover threads */
+  GroupWords = (NumProcs + 2 + WORD_BITS - 1) / WORD_BITS;
+  k = 1;
+  for(i=0; i < NFUTEX; i++) {
+    int end = (NumProcs < NFUTEX) ? k + NumProcs : k + NumProcs/NFUTEX;
+    int size = 0;
+    if (i == NFUTEX - 1)
+      end = NumProcs + 1;
+    if (!groups[i].members)
+      groups[i].members = calloc(GroupWords, sizeof(unsigned long));
+    assert(groups[i].members != NULL);
+    memset((void*)groups[i].members, 0, GroupWords * sizeof(unsigned long));
+    groups[i].begin = k;
+    for(; k < end && k <= NumProcs; ++k) {
+      ++size;
+      groups[i].members[k / WORD_BITS] |= 1UL << (k % WORD_BITS);
+    }
+    groups[i].end = k;
+    groups[i].owner = -size;
+    groups[i].count = size;
+    groups[i].round = 0;
+    groups[i].sense = 0;
+    groups[i].leader = groups[i].begin;
   }
-  assert(g);
-  assert(g->threads[threadId]);
+}
+
+/* Scheduling rounds and futex syscalls of the phase, for the metrics line */
+void PrintFutexMetrics(double secs)
+{
+  struct FutexStats sum = { 0, 0, 0, 0 };
+  long rounds = 0;
+  int i;
+
+  for(i = 0; i < NFUTEX; i++)
+    rounds += groups[i].round;
+  for(i = 1; i <= NumProcs; i++) {
+    sum.waits += STATS(i).waits;
+    sum.wakes += STATS(i).wakes;
+    sum.woken += STATS(i).woken;
+    sum.spinHits += STATS(i).spinHits;
+  }
+  printf(", \"groups\": %d, \"spin\": %d, \"wake\": \"%s\", "
+         "\"rounds\": %ld, \"rounds_per_sec\": %.0f, "
+         "\"futex_waits\": %ld, \"futex_wakes\": %ld, \"woken\": %ld, "
+         "\"spin_hits\": %ld, \"syscalls_per_round\": %.2f, "
+         "\"woken_per_round\": %.2f",
+         NFUTEX, SpinMax, WakeMode, rounds, secs > 0 ? rounds / secs : 0.0,
+         sum.waits, sum.wakes, sum.woken, sum.spinHits,
+         rounds ? (double)(sum.waits + sum.wakes) / rounds : 0.0,
+         rounds ? (double)sum.woken / rounds : 0.0);
+}
+
+/* One parallel phase: barrier, then the scheduled main loop */
+void ParallelPhase(struct FutexGroup* g)
+{
+  const int npersig =
+    MaxLoop >= 1000 ? MaxLoop / 1000 :
+    MaxLoop >= 100  ? MaxLoop / 100  : 1;
+  int i, k, sense = 0;
 
   /* simple barrier */
   pthread_barrier_wait(&barrier);
 
+  RaceyPhaseBegin(threadId);
+
   /*
    * main loop:
    *
@@ -148,50 +411,67 @@ void* ThreadBody(void* tid)
      * My turn?
      */
     if (owner == threadId || owner < 0) {
-      const int isLeader = (owner == threadId) || (groupLeader(g) == threadId);
-      const int oldRound = g->round;
       /* EXECUTE */
       for (k = 0; k < npersig && i < MaxLoop; ++k, ++i) {
-        unsigned num = sig[threadId];
+        unsigned num = SIG(threadId);
         unsigned index1 = num%MAX_ELEM;
         unsigned index2;
-        num = mix(num, m[index1].value);
+        num = mix(num, M(index1));
         index2 = num%MAX_ELEM;
-        num = mix(num, m[index2].value);
-        m[index2].value = num;
-        sig[threadId] = num;
+        num = mix(num, M(index2));
+        M(index2) = num;
+        SIG(threadId) = num;
       }
       if (i == MaxLoop) {
         groupRemoveMe(g);
       }
       /* SCHEDULE NEXT */
       if (owner < 0) {
-        // execution barrier
-        __sync_fetch_and_add(&g->owner, 1);
-        while (g->owner != 0 && g->round == oldRound)
-          ;
-        // leader gets to schedule
-        if (isLeader) {
-          g->owner = groupPickNext(g);
-          g->round++;
-          futex(&g->round, FUTEX_WAKE, 33);
-        } else {
-          while (futex(&g->round, FUTEX_WAIT, oldRound) == EINTR)
-            ;
-        }
+        // execution barrier: the leader schedules once everyone is in
+        groupBarrier(g, &sense, i == MaxLoop);
       } else {
-        // always wake everyone
-        g->owner = groupPickNext(g);
-        g->round++;
-        futex(&g->owner, FUTEX_WAKE, 33);
+        groupSchedule(g);
+        wakeTurn(g);
       }
     }
     /*************************************************
      * Wait for my turn!
      */
     else {
-      futex(&g->owner, FUTEX_WAIT, owner);
-      sig[threadId]++;  // muck with this each time we wake
+      waitTurn(g, owner);
+      SIG(threadId)++;  // muck with this each time we wake
+    }
+  }
+  RaceyPhaseEnd(threadId, MaxLoop);
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  struct FutexGroup* g = NULL;
+  int i, rep;
+
+  threadId = *(int*) tid;
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+  spinLimit = SpinMax;
+
+  for(i=0; i<NFUTEX; ++i) {
+    g = groups + i;
+    if (groupNextMember(g, threadId, threadId + 1) == threadId)
+      break;
+  }
+  assert(g);
+  assert(groupNextMember(g, threadId, threadId + 1) == threadId);
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase(g);
+    /* let main() collect sig[] and reset the shared variables */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
     }
   }
 
@@ -205,25 +485,44 @@ main(int argc, char* argv[])
   int*           tids;
   pthread_attr_t attr;
   int            ret;
-  int            mix_sig, i, k;
+  int            mix_sig, i, rep;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
-
-  /* Initialize the mix array */
-  for(i = 0; i < MAX_ELEM; i++) {
-    m[i].value = mix(i,i);
+  assert(Reps > 0);
+  assert(SpinMax >= 0);
+  assert(NumGroups > 0);
+  if (strcmp(WakeMode, "all") == 0)
+    WakeKind = WAKE_ALL;
+  else if (strcmp(WakeMode, "bitset") == 0)
+    WakeKind = WAKE_BITSET;
+  else if (strcmp(WakeMode, "thread") == 0)
+    WakeKind = WAKE_THREAD;
+  else {
+    fprintf(stderr, "unknown --wake=%s\n", WakeMode);
+    exit(1);
   }
 
+  /* Initialize the mix array, sig[] and the futex groups */
+  RaceyAllocElems(0);
+  sigSlots = RaceyAllocSigs(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  statSlots = RaceyAllocSlots(NumProcs + 1);
+  groups = RaceyAllocSlots(NFUTEX);
+  turnSlots = RaceyAllocSlots(NumProcs + 1);
+  InitShared();
+
   /* Initialize array of thread structures */
   threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
   assert(threads != NULL);
@@ -236,21 +535,12 @@ main(int argc, char* argv[])
 
   ret = pthread_barrier_init(&barrier, NULL, NumProcs);
   assert(ret == 0);
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
+  RaceyMetricsExtra = PrintFutexMetrics;
 
-  /* Initialize futex groups */
-  k = 1;
-  for(i=0; i < NFUTEX; i++) {
-    int end = (NumProcs < NFUTEX) ? k + NumProcs : k + NumProcs/NFUTEX;
-    int size = 0;
-    groups[i].begin = k;
-    for(; k < end && k <= NumProcs; ++k) {
-      ++size;
-      groups[i].threads[k] = 1;
-    }
-    groups[i].end = k;
-    groups[i].owner = -size;
-    groups[i].round = 0;
-  }
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyForkServer(NULL, NULL);
 
   for(i=0; i < NumProcs; i++) {
     /* ************************************************************
@@ -265,33 +555,48 @@ main(int argc, char* argv[])
     assert(ret == 0);
   }
 
-  /* Wait for each of the threads to terminate */
-  for(i=0; i < NumProcs; i++) {
-    ret = pthread_join(threads[i], NULL);
-    assert(ret == 0);
-  }
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
 
-  /* compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig[i], mix_sig);
-  }
+    /* compute the result */
+    mix_sig = SIG(0);
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
 
-  /* end of parallel phase */
+    /* end of parallel phase */
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
 
   pthread_attr_destroy(&attr);
   pthread_barrier_destroy(&barrier);
+  pthread_barrier_destroy(&repBarrier);
 
   return 0;
 }
@@ -24,14 +24,19 @@
  * - MaxLoop is an optional command line parameter
  * - Can spawn 32 threads (previous max was 15)
  */
+#define _GNU_SOURCE     /* PTHREAD_MUTEX_ADAPTIVE_NP */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <string.h>
+#include <sched.h>
+#include "racey-common.h"
 
 int MaxLoop = 50000;
-#define MAX_ELEM 64
+int Reps = 1;
+#define MAX_ELEM RaceyNumElems   /* --elems */
 #define PAGE_SIZE (1 << 10)
 
 #define PRIME1   103072243
@@ -39,28 +44,210 @@ int MaxLoop = 50000;
 
 int               NumProcs;
 pthread_barrier_t barrier;       /* ThreadBody barrier */
+pthread_barrier_t repBarrier;    /* main + threads, between repetitions */
+
+const char*       LockKind = "mutex";
+int               NumStripes = 8;
+int               ReadPct = 0;
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "lock", RACEY_STR, &LockKind,
+    "mutex (default), adaptive, ttas, ticket, mcs or rwlock" },
+  { "stripes", RACEY_INT, &NumStripes,
+    "number of locks guarding m[], 1 to --elems (default 8)" },
+  { "read-pct", RACEY_INT, &ReadPct,
+    "percent of iterations that only read m[] (default 0)" },
+  RACEY_ELEM_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* private variables (sig[i] private to thread i) */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
+char*    sigSlots;  /* sig[i], laid out by --layout */
+#define  SIG(i)   RACEY_SIG(sigSlots, i)
 
 /* shared variables */
-union {
-  char b[64];   /* 64 bytes cache line */
-  int value;
-} m[MAX_ELEM];
+#define  M(i)     RACEY_ELEM(i)   /* m[i], see racey-common.h */
+
+/*
+ * locks for NumStripes partitions of m[], one cache line each
+ *
+ *   mutex     pthread mutex with default attributes
+ *   adaptive  PTHREAD_MUTEX_ADAPTIVE_NP, spins briefly before sleeping
+ *   ttas      test-and-test-and-set spinlock
+ *   ticket    FIFO ticket spinlock
+ *   mcs       MCS queue lock, each waiter spins on its own node
+ *   rwlock    pthread rwlock: reads of m[] share, the update is exclusive
+ *
+ * With --read-pct=P, about P% of the iterations only read m[index2] as
+ * well, so with rwlock they take nothing but shared locks.
+ *
+ * The spinlocks yield the cpu after SPIN_LIMIT tries, so that a waiter
+ * does not burn its whole time slice while the holder (or, for the FIFO
+ * locks, the next in line) is preempted on an oversubscribed machine.
+ */
+enum { MUTEX, TTAS, TICKET, MCS, RWLOCK };
+
+struct McsNode {
+  struct McsNode* volatile next;
+  volatile int             locked;
+} __attribute__((aligned(RACEY_CACHE_LINE)));
+
+union Stripe {
+  pthread_mutex_t           mutex;
+  pthread_rwlock_t          rwlock;
+  volatile int              ttas;
+  struct {
+    volatile unsigned next;
+    volatile unsigned serving;
+  }                         ticket;
+  struct McsNode* volatile  mcs;   /* tail of the queue */
+} __attribute__((aligned(RACEY_CACHE_LINE)));
 
-/* locks for NLOCK partitions of m[] */
-#define NLOCK 8
-pthread_mutex_t  locks[NLOCK];
+int             lockType;
+union Stripe*   locks;
+__thread struct McsNode mcsNode;   /* a thread holds one lock at a time */
 
-void lockItem(unsigned index) {
-  pthread_mutex_lock(&locks[index % NLOCK]);
+#define SPIN_LIMIT 1000
+
+static inline void cpuRelax(int* spins) {
+  if (++*spins >= SPIN_LIMIT) {
+    *spins = 0;
+    sched_yield();
+    return;
+  }
+  RaceyPause();
+}
+
+void lockItem(unsigned index, int write) {
+  union Stripe* s = &locks[index % NumStripes];
+  struct McsNode* prev;
+  unsigned ticket;
+  int spins = 0;
+
+  switch (lockType) {
+  case MUTEX:
+    pthread_mutex_lock(&s->mutex);
+    break;
+  case TTAS:
+    while (__sync_lock_test_and_set(&s->ttas, 1)) {
+      while (s->ttas)
+        cpuRelax(&spins);
+    }
+    break;
+  case TICKET:
+    ticket = __sync_fetch_and_add(&s->ticket.next, 1);
+    while (s->ticket.serving != ticket)
+      cpuRelax(&spins);
+    break;
+  case MCS:
+    mcsNode.next = NULL;
+    mcsNode.locked = 1;
+    prev = __sync_lock_test_and_set(&s->mcs, &mcsNode);
+    if (prev) {
+      prev->next = &mcsNode;
+      while (mcsNode.locked)
+        cpuRelax(&spins);
+    }
+    break;
+  case RWLOCK:
+    if (write)
+      pthread_rwlock_wrlock(&s->rwlock);
+    else
+      pthread_rwlock_rdlock(&s->rwlock);
+    break;
+  }
 }
 
 void unlockItem(unsigned index) {
-  pthread_mutex_unlock(&locks[index % NLOCK]);
+  union Stripe* s = &locks[index % NumStripes];
+  int spins = 0;
+
+  switch (lockType) {
+  case MUTEX:
+    pthread_mutex_unlock(&s->mutex);
+    break;
+  case TTAS:
+    __sync_lock_release(&s->ttas);
+    break;
+  case TICKET:
+    __sync_synchronize();
+    s->ticket.serving++;
+    break;
+  case MCS:
+    if (!mcsNode.next) {
+      if (__sync_bool_compare_and_swap(&s->mcs, &mcsNode, NULL))
+        break;
+      /* a waiter swapped itself in, wait for it to link up */
+      while (!mcsNode.next)
+        cpuRelax(&spins);
+    }
+    __sync_synchronize();
+    mcsNode.next->locked = 0;
+    break;
+  case RWLOCK:
+    pthread_rwlock_unlock(&s->rwlock);
+    break;
+  }
+}
+
+/* Allocate and initialize the locks chosen by --lock and --stripes */
+void InitLocks()
+{
+  pthread_mutexattr_t mattr;
+  int i, ret;
+
+  if (NumStripes < 1 || NumStripes > MAX_ELEM) {
+    fprintf(stderr, "--stripes must be 1 to %d\n", MAX_ELEM);
+    exit(1);
+  }
+  if (ReadPct < 0 || ReadPct > 100) {
+    fprintf(stderr, "--read-pct must be 0 to 100\n");
+    exit(1);
+  }
+  ret = posix_memalign((void**)&locks, RACEY_CACHE_LINE,
+                       NumStripes * sizeof(union Stripe));
+  assert(ret == 0);
+  memset(locks, 0, NumStripes * sizeof(union Stripe));
+
+  pthread_mutexattr_init(&mattr);
+  if (strcmp(LockKind, "mutex") == 0) {
+    lockType = MUTEX;
+  } else if (strcmp(LockKind, "adaptive") == 0) {
+    lockType = MUTEX;
+    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ADAPTIVE_NP);
+  } else if (strcmp(LockKind, "ttas") == 0) {
+    lockType = TTAS;
+  } else if (strcmp(LockKind, "ticket") == 0) {
+    lockType = TICKET;
+  } else if (strcmp(LockKind, "mcs") == 0) {
+    lockType = MCS;
+  } else if (strcmp(LockKind, "rwlock") == 0) {
+    lockType = RWLOCK;
+  } else {
+    fprintf(stderr, "unknown --lock=%s\n", LockKind);
+    exit(1);
+  }
+
+  for(i=0; i < NumStripes; ++i) {
+    if (lockType == MUTEX) {
+      ret = pthread_mutex_init(&locks[i].mutex, &mattr);
+      assert(ret == 0);
+    } else if (lockType == RWLOCK) {
+      ret = pthread_rwlock_init(&locks[i].rwlock, NULL);
+      assert(ret == 0);
+    }
+  }
+  pthread_mutexattr_destroy(&mattr);
+}
+
+/* lock, stripes and read mix, for the metrics line; two locks per iteration */
+void PrintLockMetrics(double secs)
+{
+  printf(", \"lock\": \"%s\", \"stripes\": %d, \"read_pct\": %d, "
+         "\"locks_per_sec\": %.0f", LockKind, NumStripes, ReadPct,
+         secs > 0 ? 2.0 * NumProcs * MaxLoop / secs : 0.0);
 }
 
 /* the mix function */
@@ -68,18 +255,28 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
-/* The function which is called once the thread is created */
-void* ThreadBody(void* tid)
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
 {
-  int threadId = *(int *) tid;
   int i;
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  for(i = 0; i < MAX_ELEM; i++) {
+    M(i) = mix(i,i);
+  }
+}
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
+/* One parallel phase: barrier, then the main loop */
+void ParallelPhase(int threadId)
+{
+  int i;
 
   /* simple barrier, pass only once */
   pthread_barrier_wait(&barrier);
 
+  RaceyPhaseBegin(threadId);
+
   /*
    * main loop:
    *
@@ -90,22 +287,48 @@ void* ThreadBody(void* tid)
    * should change the final value of mix
    */
   for(i = 0 ; i < MaxLoop; i++) {
-    unsigned num = sig[threadId];
+    unsigned num = SIG(threadId);
     unsigned index1 = num%MAX_ELEM;
     unsigned index2;
     {
-      lockItem(index1);
-      num = mix(num, m[index1].value);
+      lockItem(index1, 0);
+      num = mix(num, M(index1));
       unlockItem(index1);
     }
     index2 = num%MAX_ELEM;
-    {
-      lockItem(index2);
-      num = mix(num, m[index2].value);
-      m[index2].value = num;
+    if (num / MAX_ELEM % 100 < (unsigned)ReadPct) {
+      /* read-only iteration */
+      lockItem(index2, 0);
+      num = mix(num, M(index2));
+      unlockItem(index2);
+    } else {
+      lockItem(index2, 1);
+      num = mix(num, M(index2));
+      M(index2) = num;
       unlockItem(index2);
     }
-    sig[threadId] = num;
+    SIG(threadId) = num;
+  }
+  RaceyPhaseEnd(threadId, MaxLoop);
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  int threadId = *(int *) tid;
+  int rep;
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase(threadId);
+    /* let main() collect sig[] and reset the shared variables */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
+    }
   }
   return NULL;
 }
@@ -117,24 +340,28 @@ main(int argc, char* argv[])
   int*           tids;
   pthread_attr_t attr;
   int            ret;
-  int            mix_sig, i;
+  int            mix_sig, i, rep;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
+  assert(Reps > 0);
 
-  /* Initialize the mix array */
-  for(i = 0; i < MAX_ELEM; i++) {
-    m[i].value = mix(i,i);
-  }
+  /* Initialize the mix array and sig[] */
+  RaceyAllocElems(0);
+  sigSlots = RaceyAllocSigs(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  InitShared();
 
   /* Initialize array of thread structures */
   threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
@@ -148,11 +375,14 @@ main(int argc, char* argv[])
 
   ret = pthread_barrier_init(&barrier, NULL, NumProcs);
   assert(ret == 0);
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
 
-  for(i=0; i < NLOCK; ++i) {
-    ret = pthread_mutex_init(&locks[i], NULL);
-    assert(ret == 0);
-  }
+  InitLocks();
+  RaceyMetricsExtra = PrintLockMetrics;
+
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyForkServer(NULL, NULL);
 
   for(i=0; i < NumProcs; i++) {
     /* ************************************************************
@@ -167,35 +397,54 @@ main(int argc, char* argv[])
     assert(ret == 0);
   }
 
-  /* Wait for each of the threads to terminate */
-  for(i=0; i < NumProcs; i++) {
-    ret = pthread_join(threads[i], NULL);
-    assert(ret == 0);
-  }
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
 
-  /* compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig[i], mix_sig);
-  }
+    /* compute the result */
+    mix_sig = SIG(0);
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
 
-  /* end of parallel phase */
+    /* end of parallel phase */
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
 
   pthread_attr_destroy(&attr);
   pthread_barrier_destroy(&barrier);
-  for(i=0; i < NLOCK; ++i)
-    pthread_mutex_destroy(&locks[i]);
+  pthread_barrier_destroy(&repBarrier);
+  for(i=0; i < NumStripes; ++i) {
+    if (lockType == MUTEX)
+      pthread_mutex_destroy(&locks[i].mutex);
+    else if (lockType == RWLOCK)
+      pthread_rwlock_destroy(&locks[i].rwlock);
+  }
 
   return 0;
 }
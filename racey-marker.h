@@ -0,0 +1,100 @@
+/*
+ * racey-marker.h
+ *
+ * Markers around the calls DMP must see: RACEY_MARK_BEGIN() before a
+ * call that may block (read, accept, a lock), RACEY_MARK_END() once it
+ * returns, and RACEY_MARK_RELEASE() on the way out of a critical
+ * section.  Build with one of
+ *
+ *   -DRACEY_MARKERS_DMP   the DMP marker syscalls 318, 319 and 320
+ *   -DRACEY_MARKERS_USDT  USDT probes racey:mark_begin, racey:mark_end
+ *                         and racey:mark_release (the default)
+ *   -DRACEY_MARKERS_NONE  nothing at all
+ *
+ * On a stock kernel each DMP marker is a wasted syscall, so only DMP
+ * builds should use them.  A USDT probe is a single nop plus an ELF
+ * note, which perf and bpftrace can attach to, e.g.
+ *   bpftrace -e 'usdt:./racey-forkpipe:racey:mark_begin { @[pid] = count(); }'
+ * Without <sys/sdt.h> the note is written by hand on 64-bit GNU
+ * targets; elsewhere the USDT markers compile to nothing.
+ */
+#ifndef RACEY_MARKER_H
+#define RACEY_MARKER_H
+
+#if !defined(RACEY_MARKERS_DMP) && !defined(RACEY_MARKERS_NONE)
+#define RACEY_MARKERS_USDT
+#endif
+
+#if defined(RACEY_MARKERS_DMP)
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * On a stock kernel 318 and 319 are getrandom() and memfd_create():
+ * pass null arguments, since with whatever is left in the registers
+ * getrandom() scribbles over memory, and keep errno from the syscall
+ * being marked.
+ */
+static inline void RaceyMark(long nr)
+{
+  const int saved = errno;
+  syscall(nr, NULL, 0, 0);
+  errno = saved;
+}
+#define RACEY_MARK_BEGIN()   RaceyMark(318)
+#define RACEY_MARK_END()     RaceyMark(319)
+#define RACEY_MARK_RELEASE() RaceyMark(320)
+
+#elif defined(RACEY_MARKERS_USDT) && defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define RACEY_MARK_BEGIN()   STAP_PROBE(racey, mark_begin)
+#define RACEY_MARK_END()     STAP_PROBE(racey, mark_end)
+#define RACEY_MARK_RELEASE() STAP_PROBE(racey, mark_release)
+
+#elif defined(RACEY_MARKERS_USDT) && defined(__GNUC__) && defined(__LP64__)
+
+/*
+ * What STAP_PROBE() emits for a probe without arguments: a nop, and a
+ * .note.stapsdt entry with its address, the address of .stapsdt.base
+ * (to find the load bias) and no semaphore.
+ */
+#define RACEY_USDT(name)                                                 \
+  __asm__ __volatile__ (                                                 \
+    "990: nop\n"                                                         \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                        \
+    ".balign 4\n"                                                        \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                   \
+    "991: .asciz \"stapsdt\"\n"                                          \
+    "992: .balign 4\n"                                                   \
+    "993: .8byte 990b\n"                                                 \
+    ".8byte _.stapsdt.base\n"                                            \
+    ".8byte 0\n"                                                         \
+    ".asciz \"racey\"\n"                                                 \
+    ".asciz \"" #name "\"\n"                                             \
+    ".asciz \"\"\n"                                                      \
+    "994: .balign 4\n"                                                   \
+    ".popsection\n"                                                      \
+    ".ifndef _.stapsdt.base\n"                                           \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                             \
+    ".hidden _.stapsdt.base\n"                                           \
+    "_.stapsdt.base: .space 1\n"                                         \
+    ".size _.stapsdt.base, 1\n"                                          \
+    ".popsection\n"                                                      \
+    ".endif\n")
+#define RACEY_MARK_BEGIN()   RACEY_USDT(mark_begin)
+#define RACEY_MARK_END()     RACEY_USDT(mark_end)
+#define RACEY_MARK_RELEASE() RACEY_USDT(mark_release)
+
+#else
+
+#define RACEY_MARK_BEGIN()   ((void)0)
+#define RACEY_MARK_END()     ((void)0)
+#define RACEY_MARK_RELEASE() ((void)0)
+
+#endif
+
+#endif /* RACEY_MARKER_H */
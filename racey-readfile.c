@@ -29,10 +29,29 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include "racey-common.h"
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 int MaxLoop = 50000;
+int Reps = 1;
+const char* IoMode = "read";   /* --io */
+int BufferSize = 256;          /* --buffer */
+#define MAX_BUFFER (1 << 20)
+int Depth = 8;                 /* --depth: io_uring reads in flight */
+int FixedBuffers = 0;          /* --fixed: io_uring registered buffers */
+int SqPoll = 0;                /* --sqpoll: io_uring kernel submission thread */
+const char* GenerateSize = NULL;   /* --generate */
+int Seed = 1;                  /* --seed */
+int GenerateOnly = 0;          /* --generate-only */
+const char* CacheMode = "as-is";   /* --cache */
 #define MAX_ELEM 64
 #define PAGE_SIZE (1 << 10)
 
@@ -41,12 +60,59 @@ int MaxLoop = 50000;
 
 int               NumProcs;
 pthread_barrier_t barrier;       /* ThreadBody barrier */
+pthread_barrier_t repBarrier;    /* main + threads, between repetitions */
 int               globalfd;
+off_t             FileSize;
+
+/*
+ * --io: how the threads split the file into chunks of --buffer bytes.
+ * read shares the fd and its file position, as racey always did.
+ * pread claims the next chunk's offset with an atomic add.  mmap claims
+ * chunks the same way and scans them in place in a read-only mapping.
+ * uring claims chunks like pread, keeps --depth of them in flight on a
+ * per-thread io_uring and hashes them in completion order.  Each chunk
+ * is mixed into the sig[] of the thread that took it, the same way in
+ * every mode.
+ */
+enum { IO_READ, IO_PREAD, IO_MMAP, IO_URING } IoKind;
+
+/*
+ * --cache: before each phase, leave the file's pages alone (as-is),
+ * read the whole file (warm), or drop it from the page cache with
+ * POSIX_FADV_DONTNEED (cold).  Resident is the fraction of the file
+ * in the page cache as the phase starts, from mincore().
+ */
+enum { CACHE_ASIS, CACHE_WARM, CACHE_COLD } CacheKind;
+double            Resident;
+volatile off_t    nextOffset;    /* pread, mmap: start of the next chunk */
+const char*       fileMap;       /* mmap: the whole file */
+
+/* per-thread counts for the metrics line, reset by InitShared() */
+struct ReadStats {
+  long long bytes;
+  long      syscalls;
+};
+char*    statSlots;
+#define  STATS(i) RACEY_SLOT(statSlots, i, struct ReadStats)
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "io", RACEY_STR, &IoMode, "how to read the file: read, pread, mmap or uring" },
+  { "buffer", RACEY_INT, &BufferSize, "bytes per chunk, a multiple of 4 up to 1M" },
+  { "depth", RACEY_INT, &Depth, "--io=uring: reads in flight per thread" },
+  { "fixed", RACEY_FLAG, &FixedBuffers, "--io=uring: register the buffers, READ_FIXED" },
+  { "sqpoll", RACEY_FLAG, &SqPoll, "--io=uring: submit through a kernel SQPOLL thread" },
+  { "generate", RACEY_STR, &GenerateSize, "first write <file>: SIZE bytes (K, M, G suffix) from --seed" },
+  { "seed", RACEY_INT, &Seed, "--generate: seed of the file contents" },
+  { "generate-only", RACEY_FLAG, &GenerateOnly, "exit after --generate" },
+  { "cache", RACEY_STR, &CacheMode, "page cache before each phase: as-is, warm or cold" },
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* shared variables */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
+char*    sigSlots;  /* sig[i], one cache line per thread */
+#define  SIG(i)   RACEY_SLOT(sigSlots, i, unsigned)
 
 
 /* the mix function */
@@ -54,21 +120,392 @@ unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
-/* The function which is called once the thread is created */
-void* ThreadBody(void* tid)
+/*
+ * --generate: the file holds 32-bit words, word w being a function of w
+ * and --seed only, so any block can be written or checked on its own.
+ */
+#define GEN_BLOCK (1 << 20)
+
+static void GenerateBlock(char* buf, off_t off, size_t len)
+{
+  unsigned long long w = off / sizeof(unsigned);
+  static unsigned words[GEN_BLOCK / sizeof(unsigned)];
+  size_t k;
+
+  for (k = 0; k < (len + sizeof(unsigned) - 1) / sizeof(unsigned); k++, w++)
+    words[k] = mix(mix((unsigned)w, Seed ^ (unsigned)(w >> 32)), (unsigned)w);
+  memcpy(buf, words, len);
+}
+
+static off_t ParseSize(const char* s)
+{
+  char* end;
+  long long size;
+  int shift = 0;
+
+  errno = 0;
+  size = strtoll(s, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': shift += 10;   /* fall through */
+  case 'M': case 'm': shift += 10;   /* fall through */
+  case 'K': case 'k': shift += 10;
+    end++;
+  }
+  /* range-check before shifting, so that a huge size cannot wrap */
+  if (errno == ERANGE || size > (LLONG_MAX >> shift)) {
+    fprintf(stderr, "--generate=%s: too large\n", s);
+    exit(1);
+  }
+  size <<= shift;
+  if (*end != '\0' || size <= 0) {
+    fprintf(stderr, "--generate=%s: want a size like 4096, 64K, 100M or 10G\n", s);
+    exit(1);
+  }
+  return size;
+}
+
+/* Does path already hold size bytes from --seed?  Checks the first and last blocks */
+static int GeneratedAlready(const char* path, off_t size)
+{
+  static char want[GEN_BLOCK], have[GEN_BLOCK];
+  const off_t offs[2] = { 0, (size - 1) / GEN_BLOCK * GEN_BLOCK };
+  struct stat st;
+  int fd, i, same = 1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_size != size)
+    same = 0;
+  for (i = 0; i < 2 && same; i++) {
+    size_t len = size - offs[i] < GEN_BLOCK ? size - offs[i] : GEN_BLOCK;
+    GenerateBlock(want, offs[i], len);
+    same = pread(fd, have, len, offs[i]) == (ssize_t)len &&
+           memcmp(want, have, len) == 0;
+  }
+  close(fd);
+  return same;
+}
+
+static void GenerateFile(const char* path, off_t size)
+{
+  static char buf[GEN_BLOCK];
+  off_t off;
+  int fd;
+
+  if (GeneratedAlready(path, size))
+    return;
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open");
+    exit(1);
+  }
+  for (off = 0; off < size; off += GEN_BLOCK) {
+    size_t len = size - off < GEN_BLOCK ? size - off : GEN_BLOCK;
+    GenerateBlock(buf, off, len);
+    if (write(fd, buf, len) != (ssize_t)len) {
+      perror("write");
+      exit(1);
+    }
+  }
+  /* written back, so that --cache=cold can drop the pages */
+  if (fdatasync(fd) < 0 || close(fd) < 0) {
+    perror("fdatasync");
+    exit(1);
+  }
+}
+
+/* --cache: set up the page cache for the next phase, and measure it */
+static void PrepareCache(void)
+{
+  static char buf[GEN_BLOCK];
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t pages = (FileSize + page - 1) / page;
+  unsigned char* vec;
+  void* map;
+  off_t off;
+  size_t i, n = 0;
+
+  if (CacheKind == CACHE_WARM) {
+    posix_fadvise(globalfd, 0, 0, POSIX_FADV_WILLNEED);
+    for (off = 0; pread(globalfd, buf, sizeof buf, off) > 0; off += sizeof buf)
+      ;
+  } else if (CacheKind == CACHE_COLD) {
+    /* our own mapping would keep the pages in */
+    if (fileMap)
+      madvise((void*)fileMap, FileSize, MADV_DONTNEED);
+    posix_fadvise(globalfd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+  map = mmap(NULL, FileSize, PROT_READ, MAP_SHARED, globalfd, 0);
+  vec = malloc(pages);
+  if (map != MAP_FAILED && vec && mincore(map, FileSize, vec) == 0) {
+    for (i = 0; i < pages; i++)
+      n += vec[i] & 1;
+  }
+  Resident = (double)n / pages;
+  free(vec);
+  if (map != MAP_FAILED)
+    munmap(map, FileSize);
+}
+
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
+{
+  int i;
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  memset(statSlots, 0, (size_t)(NumProcs + 1) * RACEY_CACHE_LINE);
+  lseek(globalfd, 0, SEEK_SET);
+  nextOffset = 0;
+  PrepareCache();
+}
+
+/* Bytes and syscalls of the phase, for the metrics line */
+void PrintReadMetrics(double secs)
+{
+  long long bytes = 0;
+  long syscalls = 0;
+  int i;
+
+  for(i = 1; i <= NumProcs; i++) {
+    bytes += STATS(i).bytes;
+    syscalls += STATS(i).syscalls;
+  }
+  printf(", \"io\": \"%s\", \"buffer\": %d, \"bytes\": %lld, "
+         "\"bytes_per_sec\": %.0f, \"syscalls\": %ld, "
+         "\"syscalls_per_sec\": %.0f",
+         IoMode, BufferSize, bytes, secs > 0 ? bytes / secs : 0.0,
+         syscalls, secs > 0 ? syscalls / secs : 0.0);
+  if (IoKind == IO_URING)
+    printf(", \"depth\": %d, \"fixed\": %d, \"sqpoll\": %d",
+           Depth, FixedBuffers, SqPoll);
+  printf(", \"file_bytes\": %lld, \"cache\": \"%s\", \"resident\": %.3f",
+         (long long)FileSize, CacheMode, Resident);
+}
+
+/*
+ * --io=uring, through the raw syscalls (no liburing).  Each thread sets
+ * up its own ring of --depth entries; slot i of its buffer is the
+ * target of the read whose user_data is i.
+ */
+struct Uring {
+  int                  fd;
+  unsigned             sqEntries, cqEntries;
+  size_t               sqSize, cqSize;
+  char*                sq;
+  char*                cq;
+  unsigned*            sqHead;
+  unsigned*            sqTail;
+  unsigned*            sqMask;
+  unsigned*            sqFlags;
+  unsigned*            sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned*            cqHead;
+  unsigned*            cqTail;
+  unsigned*            cqMask;
+  struct io_uring_cqe* cqes;
+};
+__thread struct Uring ring;
+
+static void UringSetup(char* buffer)
+{
+  struct io_uring_params p;
+  struct iovec* iov;
+  int i;
+
+  memset(&p, 0, sizeof p);
+  if (SqPoll) {
+    p.flags |= IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = 100;   /* ms */
+  }
+  ring.fd = syscall(__NR_io_uring_setup, Depth, &p);
+  if (ring.fd < 0) {
+    perror("io_uring_setup");
+    exit(1);
+  }
+  ring.sqEntries = p.sq_entries;
+  ring.cqEntries = p.cq_entries;
+  ring.sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cqSize > ring.sqSize)
+      ring.sqSize = ring.cqSize;
+    ring.cqSize = 0;
+  }
+  ring.sq = mmap(NULL, ring.sqSize, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.cq = ring.cqSize == 0 ? ring.sq :
+            mmap(NULL, ring.cqSize, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+  if (ring.sq == MAP_FAILED || ring.cq == MAP_FAILED ||
+      ring.sqes == MAP_FAILED) {
+    perror("mmap io_uring");
+    exit(1);
+  }
+  ring.sqHead = (unsigned*)(ring.sq + p.sq_off.head);
+  ring.sqTail = (unsigned*)(ring.sq + p.sq_off.tail);
+  ring.sqMask = (unsigned*)(ring.sq + p.sq_off.ring_mask);
+  ring.sqFlags = (unsigned*)(ring.sq + p.sq_off.flags);
+  ring.sqArray = (unsigned*)(ring.sq + p.sq_off.array);
+  ring.cqHead = (unsigned*)(ring.cq + p.cq_off.head);
+  ring.cqTail = (unsigned*)(ring.cq + p.cq_off.tail);
+  ring.cqMask = (unsigned*)(ring.cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(ring.cq + p.cq_off.cqes);
+
+  if (FixedBuffers) {
+    iov = calloc(Depth, sizeof *iov);
+    assert(iov != NULL);
+    for (i = 0; i < Depth; i++) {
+      iov[i].iov_base = buffer + (size_t)i * BufferSize;
+      iov[i].iov_len = BufferSize;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                iov, Depth) < 0) {
+      perror("io_uring_register");
+      exit(1);
+    }
+    free(iov);
+  }
+}
+
+static void UringTeardown(void)
+{
+  munmap(ring.sqes, ring.sqEntries * sizeof(struct io_uring_sqe));
+  if (ring.cq != ring.sq)
+    munmap(ring.cq, ring.cqSize);
+  munmap(ring.sq, ring.sqSize);
+  close(ring.fd);
+}
+
+/* Claim the next chunk and queue its read into slot; 0 at EOF */
+static int UringQueue(char* buffer, int slot)
+{
+  const off_t off = __sync_fetch_and_add(&nextOffset, BufferSize);
+  const unsigned tail = *ring.sqTail;
+  const unsigned idx = tail & *ring.sqMask;
+  struct io_uring_sqe* sqe = &ring.sqes[idx];
+
+  if (off >= FileSize)
+    return 0;
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = FixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = globalfd;
+  sqe->off = off;
+  sqe->addr = (unsigned long)(buffer + (size_t)slot * BufferSize);
+  sqe->len = BufferSize;
+  sqe->buf_index = slot;
+  sqe->user_data = slot;
+  ring.sqArray[idx] = idx;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * Hand toSubmit new entries to the kernel and wait for a completion,
+ * unless one is already there.  With --sqpoll the kernel thread picks
+ * the entries up itself; it only needs a syscall when it went idle.
+ */
+static void UringEnter(int toSubmit, struct ReadStats* st)
+{
+  unsigned flags = 0;
+  int waitFor = 1;
+
+  if (*ring.cqHead != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+    waitFor = 0;
+  if (SqPoll) {
+    __sync_synchronize();
+    if (*ring.sqFlags & IORING_SQ_NEED_WAKEUP)
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    toSubmit = 0;
+  }
+  if (waitFor)
+    flags |= IORING_ENTER_GETEVENTS;
+  if (toSubmit == 0 && flags == 0)
+    return;
+  if (syscall(__NR_io_uring_enter, ring.fd, toSubmit, waitFor, flags,
+              NULL, 0) < 0 && errno != EINTR) {
+    perror("io_uring_enter");
+    exit(1);
+  }
+  st->syscalls++;
+}
+
+/*
+ * One phase of --io=uring: keep up to --depth reads in flight and hash
+ * each chunk as it completes.  Returns the number of chunks, counting
+ * the EOF the way the read() loop does.
+ */
+static int UringRead(struct ReadStats* st, char* buffer, int* nump)
+{
+  int num = *nump;
+  int inflight = 0, toSubmit = 0, eof = 0, chunks = 0;
+  int slot, k, r;
+
+  for (slot = 0; slot < Depth && !eof; slot++) {
+    if (UringQueue(buffer, slot)) {
+      inflight++;
+      toSubmit++;
+    } else {
+      eof = 1;
+    }
+  }
+  while (inflight > 0) {
+    unsigned head;
+    UringEnter(toSubmit, st);
+    toSubmit = 0;
+    /* the completions that are in, in the order they completed */
+    head = *ring.cqHead;
+    while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+      const int* numbers;
+      slot = cqe->user_data;
+      r = cqe->res;
+      __atomic_store_n(ring.cqHead, ++head, __ATOMIC_RELEASE);
+      if (r < 0) {
+        errno = -r;
+        perror("io_uring read");
+        exit(1);
+      }
+      inflight--;
+      chunks++;
+      num = mix(num, r);
+      st->bytes += r;
+      numbers = (const int*)(buffer + (size_t)slot * BufferSize);
+      for (k = 0; k < r / sizeof(*numbers); k++)
+        num = mix(num, numbers[k]);
+      if (!eof) {
+        if (UringQueue(buffer, slot)) {
+          inflight++;
+          toSubmit++;
+        } else {
+          eof = 1;
+        }
+      }
+    }
+  }
+  num = mix(num, 0);
+  *nump = num;
+  return chunks + 1;
+}
+
+/* One parallel phase: barrier, then read the file until EOF */
+void ParallelPhase(int threadId, char* buffer)
 {
   const int fd = globalfd;
-  char buffer[256];
-  int* numbers = (int*)buffer;
-  int threadId = *(int *) tid;
-  int num = sig[threadId];
+  const int* numbers = (const int*)buffer;
+  struct ReadStats* st = &STATS(threadId);
+  int num = SIG(threadId);
+  off_t off;
   int i, k, r;
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
-
   /* simple barrier, pass only once */
   pthread_barrier_wait(&barrier);
+  RaceyPhaseBegin(threadId);
 
   /*
    * main loop:
@@ -76,16 +513,67 @@ void* ThreadBody(void* tid)
    * If mix() is good, any race (except read-read, which can tell by software)
    * should change the final value of mix
    */
-  for(i=0, r=1; r > 0; i++) {
-    r = read(fd, buffer, sizeof buffer);
+  if (IoKind == IO_URING)
+    i = UringRead(st, buffer, &num);
+  else for(i=0, r=1; r > 0; i++) {
+    switch (IoKind) {
+    case IO_READ:
+      r = read(fd, buffer, BufferSize);
+      st->syscalls++;
+      break;
+    case IO_PREAD:
+      off = __sync_fetch_and_add(&nextOffset, BufferSize);
+      r = pread(fd, buffer, BufferSize, off);
+      st->syscalls++;
+      break;
+    case IO_MMAP:
+      off = __sync_fetch_and_add(&nextOffset, BufferSize);
+      r = (off >= FileSize) ? 0 :
+          (FileSize - off < BufferSize) ? FileSize - off : BufferSize;
+      numbers = (const int*)(fileMap + off);
+      break;
+    case IO_URING:
+      break;
+    }
     num = mix(num, r);
     if (r > 0) {
+      st->bytes += r;
       for (k = 0; k < r / sizeof(*numbers); k++)
         num = mix(num, numbers[k]);
     }
   }
+  RaceyPhaseEnd(threadId, i);
 
-  sig[threadId] = num;
+  SIG(threadId) = num;
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  int threadId = *(int *) tid;
+  char* buffer;
+  int rep;
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+
+  buffer = malloc((size_t)BufferSize * (IoKind == IO_URING ? Depth : 1));
+  assert(buffer != NULL);
+  if (IoKind == IO_URING)
+    UringSetup(buffer);
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase(threadId, buffer);
+    /* let main() collect sig[] and rewind the file */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
+  if (IoKind == IO_URING)
+    UringTeardown();
+  free(buffer);
   return NULL;
 }
 
@@ -96,20 +584,56 @@ main(int argc, char* argv[])
   int*           tids;
   pthread_attr_t attr;
   int            ret;
-  int            mix_sig, i;
+  int            mix_sig, i, rep;
   struct stat    st;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 4) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop> <file>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> <file> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
 
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
 
   MaxLoop = atoi(argv[2]);
   assert(MaxLoop > 0);
+  assert(Reps > 0);
+  if (BufferSize <= 0 || BufferSize > MAX_BUFFER || BufferSize % sizeof(int)) {
+    fprintf(stderr, "--buffer=%d: want a multiple of %d up to %d\n",
+            BufferSize, (int)sizeof(int), MAX_BUFFER);
+    exit(1);
+  }
+  if (strcmp(IoMode, "read") == 0)
+    IoKind = IO_READ;
+  else if (strcmp(IoMode, "pread") == 0)
+    IoKind = IO_PREAD;
+  else if (strcmp(IoMode, "mmap") == 0)
+    IoKind = IO_MMAP;
+  else if (strcmp(IoMode, "uring") == 0)
+    IoKind = IO_URING;
+  else {
+    fprintf(stderr, "unknown --io=%s\n", IoMode);
+    exit(1);
+  }
+  assert(Depth > 0);
+  if (strcmp(CacheMode, "as-is") == 0)
+    CacheKind = CACHE_ASIS;
+  else if (strcmp(CacheMode, "warm") == 0)
+    CacheKind = CACHE_WARM;
+  else if (strcmp(CacheMode, "cold") == 0)
+    CacheKind = CACHE_COLD;
+  else {
+    fprintf(stderr, "unknown --cache=%s\n", CacheMode);
+    exit(1);
+  }
+
+  if (GenerateSize)
+    GenerateFile(argv[3], ParseSize(GenerateSize));
+  if (GenerateOnly)
+    return 0;
 
   /* Open the file */
   globalfd = open(argv[3], O_RDONLY);
@@ -125,6 +649,20 @@ main(int argc, char* argv[])
     fprintf(stderr, "Error: file %s is too small\n", argv[3]);
     return 1;
   }
+  FileSize = st.st_size;
+  if (IoKind == IO_MMAP) {
+    fileMap = mmap(NULL, FileSize, PROT_READ, MAP_SHARED, globalfd, 0);
+    if (fileMap == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+  }
+
+  /* Initialize sig[] */
+  sigSlots = RaceyAllocSlots(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  statSlots = RaceyAllocSlots(NumProcs + 1);
+  InitShared();
 
   /* Initialize array of thread structures */
   threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
@@ -138,6 +676,15 @@ main(int argc, char* argv[])
 
   ret = pthread_barrier_init(&barrier, NULL, NumProcs);
   assert(ret == 0);
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
+  RaceyMetricsExtra = PrintReadMetrics;
+
+  /*
+   * Setup is done: with --forkserver, each run starts here.  The child
+   * shares the file offset with the server, so reset it after each run.
+   */
+  RaceyForkServer(NULL, InitShared);
 
   for(i=0; i < NumProcs; i++) {
     /* ************************************************************
@@ -152,33 +699,48 @@ main(int argc, char* argv[])
     assert(ret == 0);
   }
 
-  /* Wait for each of the threads to terminate */
-  for(i=0; i < NumProcs; i++) {
-    ret = pthread_join(threads[i], NULL);
-    assert(ret == 0);
-  }
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
 
-  /* compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig[i], mix_sig);
-  }
+    /* compute the result */
+    mix_sig = SIG(0);
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
+
+    /* end of parallel phase */
 
-  /* end of parallel phase */
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
 
   pthread_attr_destroy(&attr);
   pthread_barrier_destroy(&barrier);
+  pthread_barrier_destroy(&repBarrier);
 
   return 0;
 }
@@ -24,15 +24,22 @@
  * - MaxLoop is an optional command line parameter
  * - Can spawn 32 threads (previous max was 15)
  */
+#define _GNU_SOURCE     /* pthread_sigqueue */
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include "racey-common.h"
 
 int MaxLoop = 50000;
-#define MAX_ELEM 64
+int Reps = 1;
+const char* DeliverMode = "kill";   /* --deliver */
+#define MAX_ELEM RaceyNumElems   /* --elems */
 #define PAGE_SIZE (1 << 10)
 
 #define PRIME1   103072243
@@ -40,68 +47,186 @@ int MaxLoop = 50000;
 
 int               NumProcs;
 pthread_barrier_t barrier;       /* ThreadBody barrier */
+pthread_barrier_t repBarrier;    /* main + threads, between repetitions */
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "deliver", RACEY_STR, &DeliverMode, "kill (SIGUSR1), sigqueue (RT signal) or signalfd" },
+  RACEY_ELEM_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
 
 /* private variables (sig[i] private to thread i) */
-unsigned sig[33] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29,
-                     30, 31, 32 };
-unsigned sig2[33]; /* initialized to the reverse of sig[] */
-pthread_t threadSelfs[33];
+char*    sigSlots;  /* sig[i], laid out by --layout */
+#define  SIG(i)   RACEY_SIG(sigSlots, i)
+char*    sig2Slots; /* sig2[i], initialized to the reverse of sig[] */
+#define  SIG2(i)  RACEY_SIG(sig2Slots, i)
+pthread_t* threadSelfs;
 __thread int threadId;
 
+/*
+ * --deliver: how a thread signals another.  kill is pthread_kill() of
+ * SIGUSR1, which coalesces while pending.  sigqueue is
+ * pthread_sigqueue() of SIGRTMIN, which queues one signal per send and
+ * carries the send time as its payload.  signalfd sends like sigqueue,
+ * but the target keeps SIGRTMIN blocked and drains its signalfd after
+ * each batch of iterations, running the handler's work synchronously.
+ */
+enum { DELIVER_KILL, DELIVER_SIGQUEUE, DELIVER_SIGNALFD } DeliverKind;
+int      SigNum;                 /* SIGUSR1 or SIGRTMIN */
+__thread int sigFd = -1;         /* --deliver=signalfd */
+
+/* per-thread counts for the metrics line, reset by InitShared() */
+struct SignalStats {
+  long      sent;                /* signals this thread sent */
+  long      dropped;             /* sends that failed: RT queue full */
+  long      delivered;           /* handler runs in this thread */
+  uintptr_t latency;             /* sum of send-to-handler ns */
+  uintptr_t maxLatency;
+  volatile uintptr_t lastSent;   /* --deliver=kill: time of the last send
+                                    to this thread, there is no payload */
+};
+char*    statSlots;
+#define  STATS(i) RACEY_SLOT(statSlots, i, struct SignalStats)
+
+/* nanoseconds, wrapping at the width of a signal's payload */
+static inline uintptr_t NowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uintptr_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
 /* shared variables */
-union {
-  char b[64];   /* 64 bytes cache line */
-  int value;
-} m[MAX_ELEM];
+#define  M(i)     RACEY_ELEM(i)   /* m[i], see racey-common.h */
 
 /* the mix function */
 unsigned mix(unsigned i, unsigned j) {
   return (i + j * PRIME2) % PRIME1;
 }
 
-/* The signal handler */
-void ThreadSignalHandler(int signum)
+/* One delivery: the handler's work, then its count and latency */
+void Deliver(uintptr_t sentAt)
 {
+  struct SignalStats* st = &STATS(threadId);
+  uintptr_t latency;
   int i;
   for(i = 0; i < 100; ++i) {
     /* Like in ThreadBody, but use sig2 !!! */
-    unsigned num = sig2[threadId];
+    unsigned num = SIG2(threadId);
     unsigned index1 = num%MAX_ELEM;
     unsigned index2;
-    num = mix(num, m[index1].value);
+    num = mix(num, M(index1));
     index2 = num%MAX_ELEM;
-    num = mix(num, m[index2].value);
-    m[index2].value = num;
-    sig2[threadId] = num;
+    num = mix(num, M(index2));
+    M(index2) = num;
+    SIG2(threadId) = num;
   }
+  latency = NowNs() - sentAt;
+  st->delivered++;
+  st->latency += latency;
+  if (latency > st->maxLatency)
+    st->maxLatency = latency;
 }
 
-/* The function which is called once the thread is created */
-void* ThreadBody(void* tid)
+/* The signal handler */
+void ThreadSignalHandler(int signum, siginfo_t* info, void* context)
 {
-  struct sigaction sa;
-  const int npersig =
-    MaxLoop >= 1000 ? MaxLoop / 1000 :
-    MaxLoop >= 100  ? MaxLoop / 100  : 1;
-  int i, k, ret;
+  if (DeliverKind == DELIVER_KILL)
+    Deliver(STATS(threadId).lastSent);
+  else
+    Deliver((uintptr_t)info->si_value.sival_ptr);
+}
 
-  /* initialize */
-  threadId = *(int *) tid;
-  threadSelfs[threadId] = pthread_self();
+/* --deliver=signalfd: run the handler's work for each pending signal */
+void DrainSignals()
+{
+  struct signalfd_siginfo info[16];
+  ssize_t n;
+  int i;
 
-  sa.sa_handler = &ThreadSignalHandler;
-  sa.sa_flags = 0;
-  sigemptyset(&sa.sa_mask);
-  ret = sigaction(SIGUSR1, &sa, NULL);
-  assert(ret == 0);
+  while ((n = read(sigFd, info, sizeof info)) > 0) {
+    for (i = 0; i < n / (ssize_t)sizeof info[0]; ++i)
+      Deliver((uintptr_t)info[i].ssi_ptr);
+  }
+  assert(n < 0 && errno == EAGAIN);
+}
+
+/* Signal thread 'to' the --deliver way */
+void SendSignal(int to)
+{
+  union sigval value;
+  int ret;
+
+  STATS(threadId).sent++;
+  if (DeliverKind == DELIVER_KILL) {
+    STATS(to).lastSent = NowNs();
+    pthread_kill(threadSelfs[to], SigNum);
+    return;
+  }
+  value.sival_ptr = (void*)NowNs();
+  ret = pthread_sigqueue(threadSelfs[to], SigNum, value);
+  if (ret == EAGAIN) {
+    STATS(threadId).sent--;
+    STATS(threadId).dropped++;
+  }
+}
+
+/* Deliveries of the phase, for the metrics line */
+void PrintSignalMetrics(double secs)
+{
+  long sent = 0, dropped = 0, delivered = 0;
+  uintptr_t latency = 0, maxLatency = 0;
+  int i;
+
+  for(i = 1; i <= NumProcs; i++) {
+    sent += STATS(i).sent;
+    dropped += STATS(i).dropped;
+    delivered += STATS(i).delivered;
+    latency += STATS(i).latency;
+    if (STATS(i).maxLatency > maxLatency)
+      maxLatency = STATS(i).maxLatency;
+  }
+  printf(", \"deliver\": \"%s\", \"sent\": %ld, \"delivered\": %ld, "
+         "\"coalesced\": %ld, \"dropped\": %ld, "
+         "\"deliveries_per_sec\": %.0f, \"latency_avg_us\": %.3f, "
+         "\"latency_max_us\": %.3f",
+         DeliverMode, sent, delivered, sent - delivered, dropped,
+         secs > 0 ? delivered / secs : 0.0,
+         delivered ? latency / 1e3 / delivered : 0.0, maxLatency / 1e3);
+}
+
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
+{
+  int i;
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  /* the reverse of the original 33-entry sig[] */
+  for(i = 0; i <= NumProcs; ++i) {
+    SIG2(i) = (i == 0) ? 0 : 33 - i;
+  }
+  for(i = 0; i < MAX_ELEM; i++) {
+    M(i) = mix(i,i);
+  }
+  memset(statSlots, 0, (size_t)(NumProcs + 1) * RACEY_CACHE_LINE);
+}
 
-  /* seize the cpu, roughly 0.5-1 second on ironsides */
-  for(i=0; i<0x07ffffff; i++) {};
+/* One parallel phase: barrier, main loop, barrier */
+void ParallelPhase()
+{
+  const int npersig =
+    MaxLoop >= 1000 ? MaxLoop / 1000 :
+    MaxLoop >= 100  ? MaxLoop / 100  : 1;
+  int i, k;
 
   /* simple barrier, so we know when all threads have installed sighandlers */
   pthread_barrier_wait(&barrier);
 
+  RaceyPhaseBegin(threadId);
+
   /*
    * main loop:
    *
@@ -113,18 +238,22 @@ void* ThreadBody(void* tid)
    */
   for(i = 0; i < MaxLoop; ) {
     for (k = 0; k < npersig && i < MaxLoop; ++k, ++i) {
-      unsigned num = sig[threadId];
+      unsigned num = SIG(threadId);
       unsigned index1 = num%MAX_ELEM;
       unsigned index2;
-      num = mix(num, m[index1].value);
+      num = mix(num, M(index1));
       index2 = num%MAX_ELEM;
-      num = mix(num, m[index2].value);
-      m[index2].value = num;
-      sig[threadId] = num;
+      num = mix(num, M(index2));
+      M(index2) = num;
+      SIG(threadId) = num;
     }
-    ret = pthread_kill(threadSelfs[(sig[threadId] % NumProcs) + 1], SIGUSR1);
+    SendSignal((SIG(threadId) % NumProcs) + 1);
+    if (sigFd >= 0)
+      DrainSignals();
   }
 
+  RaceyPhaseEnd(threadId, MaxLoop);
+
   /*
    * Would be nice to *not* put a barrier here, but some versions of
    * pthreads have a bug that causes pthread_kill() to segfault instead
@@ -132,6 +261,52 @@ void* ThreadBody(void* tid)
    */
   pthread_barrier_wait(&barrier);
 
+  /* every signal has been sent: take the ones still blocked */
+  if (sigFd >= 0)
+    DrainSignals();
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  struct sigaction sa;
+  sigset_t mask;
+  int ret, rep;
+
+  /* initialize */
+  threadId = *(int *) tid;
+  threadSelfs[threadId] = pthread_self();
+
+  sa.sa_sigaction = &ThreadSignalHandler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  ret = sigaction(SigNum, &sa, NULL);
+  assert(ret == 0);
+
+  if (DeliverKind == DELIVER_SIGNALFD) {
+    sigemptyset(&mask);
+    sigaddset(&mask, SigNum);
+    ret = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    assert(ret == 0);
+    sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    assert(sigFd >= 0);
+  }
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase();
+    /* let main() collect sig[] and reset the shared variables */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
+
+  if (sigFd >= 0)
+    close(sigFd);
   return NULL;
 }
 
@@ -142,28 +317,43 @@ main(int argc, char* argv[])
   int*           tids;
   pthread_attr_t attr;
   int            ret;
-  int            mix_sig, i;
+  int            mix_sig, i, rep;
 
   /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
   if(argc < 2) {
-    fprintf(stderr, "%s <numProcesors> <maxLoop>\n", argv[0]);
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
     exit(1);
   }
   NumProcs = atoi(argv[1]);
-  assert(NumProcs > 0 && NumProcs <= 32);
+  assert(NumProcs > 0);
   if (argc >= 3) {
     MaxLoop = atoi(argv[2]);
     assert(MaxLoop > 0);
   }
-
-  /* Initialize the mix array */
-  for(i = 0; i < MAX_ELEM; i++) {
-    m[i].value = mix(i,i);
+  assert(Reps > 0);
+  if (strcmp(DeliverMode, "kill") == 0)
+    DeliverKind = DELIVER_KILL;
+  else if (strcmp(DeliverMode, "sigqueue") == 0)
+    DeliverKind = DELIVER_SIGQUEUE;
+  else if (strcmp(DeliverMode, "signalfd") == 0)
+    DeliverKind = DELIVER_SIGNALFD;
+  else {
+    fprintf(stderr, "unknown --deliver=%s\n", DeliverMode);
+    exit(1);
   }
+  SigNum = (DeliverKind == DELIVER_KILL) ? SIGUSR1 : SIGRTMIN;
 
-  for(i = 0; i < 33; ++i) {
-    sig2[i] = sig[33-i];
-  }
+  /* Initialize the mix array, sig[] and sig2[] */
+  RaceyAllocElems(0);
+  sigSlots = RaceyAllocSigs(NumProcs + 1);
+  sig2Slots = RaceyAllocSigs(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  statSlots = RaceyAllocSlots(NumProcs + 1);
+  threadSelfs = (pthread_t *) calloc(NumProcs + 1, sizeof(pthread_t));
+  assert(threadSelfs != NULL);
+  InitShared();
 
   /* Initialize array of thread structures */
   threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
@@ -177,6 +367,12 @@ main(int argc, char* argv[])
 
   ret = pthread_barrier_init(&barrier, NULL, NumProcs);
   assert(ret == 0);
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
+  RaceyMetricsExtra = PrintSignalMetrics;
+
+  /* Setup is done: with --forkserver, each run starts here */
+  RaceyForkServer(NULL, NULL);
 
   for(i=0; i < NumProcs; i++) {
     /* ************************************************************
@@ -191,36 +387,51 @@ main(int argc, char* argv[])
     assert(ret == 0);
   }
 
-  /* Wait for each of the threads to terminate */
-  for(i=0; i < NumProcs; i++) {
-    ret = pthread_join(threads[i], NULL);
-    assert(ret == 0);
-  }
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
 
-  /* compute the result */
-  mix_sig = sig[0];
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig[i], mix_sig);
-  }
-  for(i = 1; i < NumProcs ; i++) {
-    mix_sig = mix(sig2[i], mix_sig);
-  }
+    /* compute the result */
+    mix_sig = SIG(0);
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
+    for(i = 1; i < NumProcs ; i++) {
+      mix_sig = mix(SIG2(i), mix_sig);
+    }
 
-  /* end of parallel phase */
+    /* end of parallel phase */
 
-  /* ************************************************************
-   * print results
-   *  1. mix_sig  : deterministic race?
-   *  2. &mix_sig : deterministic stack layout?
-   *  3. malloc   : deterministic heap layout?
-   * ************************************************************ */
-  printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
-         mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
-  fflush(stdout);
-  usleep(5);
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
 
   pthread_attr_destroy(&attr);
   pthread_barrier_destroy(&barrier);
+  pthread_barrier_destroy(&repBarrier);
 
   return 0;
 }
@@ -14,7 +14,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <sys/syscall.h>
+#include "../racey-marker.h"
 
 #define WORKER_NUM 10
 #define OUTPUT_FILE "./output.txt"
@@ -38,30 +38,30 @@ void* racey_worker(void* data)
 	for (;;) {
 		/* Waiting for an availiable socket */
 		for (;;) {
-			syscall(318);
+			RACEY_MARK_BEGIN();
 			pthread_mutex_lock(&client_fds_lock);
-			syscall(319);
+			RACEY_MARK_END();
 			if (client_fds[client_idx] > 0) {
 				printf("Worker got a connection %d\n", client_idx);
 				fd = client_fds[client_idx];
-				syscall(320);
+				RACEY_MARK_RELEASE();
 				client_fds[client_idx] = -1;
 				client_idx --;
 				pthread_mutex_unlock(&client_fds_lock);
 				break;
 			}
 			pthread_mutex_unlock(&client_fds_lock);
-			syscall(320);
+			RACEY_MARK_RELEASE();
 		}
 
 		/* Write the shit to the file */
 		do {
-			syscall(318);
+			RACEY_MARK_BEGIN();
 			n = read(fd, buf, sizeof(buf));
-			syscall(319);
-			syscall(318);
+			RACEY_MARK_END();
+			RACEY_MARK_BEGIN();
 			pthread_mutex_lock(&file_lock);
-			syscall(319);
+			RACEY_MARK_END();
 			write(output_fd, buf, n);
 			pthread_mutex_unlock(&file_lock);
 		} while (n > 0);
@@ -138,31 +138,31 @@ int main(int argc, char **argv)
 	for (;;) {
 		/* Accept whatever is coming to me */
 		client_len = sizeof(client_addr);
-		syscall(318);
+		RACEY_MARK_BEGIN();
 		if ((client_fd = accept(server_fd, (struct sockaddr *) &client_addr,
 						&client_len)) < 0) {
 			printf("Couldn't do shit, abort\n");
-			syscall(319);
+			RACEY_MARK_END();
 			return 1;
 		}
-		syscall(319);
-		syscall(320);
+		RACEY_MARK_END();
+		RACEY_MARK_RELEASE();
 
 		printf("Incoming connection\n");
 		while (1) {
-			syscall(318);
+			RACEY_MARK_BEGIN();
 			pthread_mutex_lock(&client_fds_lock);
-			syscall(319);
+			RACEY_MARK_END();
 			if (client_idx < WORKER_NUM) {
 				/* Feed the socket to workers */
-				syscall(320);
+				RACEY_MARK_RELEASE();
 				client_idx ++;
 				client_fds[client_idx] = client_fd;
 				pthread_mutex_unlock(&client_fds_lock);
 				break;
 			}
 			pthread_mutex_unlock(&client_fds_lock);
-			syscall(320);
+			RACEY_MARK_RELEASE();
 		}
 		printf("Connection put into position %d\n", client_idx);
 	}
@@ -0,0 +1,393 @@
+/*
+ * RACEY: a program print a result which is very sensitive to the
+ * ordering between processors (races).
+ *
+ * It is important to "align" the short parallel executions in the
+ * simulated environment. First, a simple barrier is used to make sure
+ * thread on different processors are starting at roughly the same time.
+ * Second, each thread is bound to a physical cpu. Third, before the main
+ * loop starts, each thread use a tight loop to gain the long time slice
+ * from the OS scheduler.
+ *
+ * Author: Min Xu <mxu@cae.wisc.edu>
+ * Main idea: Due to Mark Hill
+ * Created: 09/20/02
+ *
+ * Compile (on Solaris for Simics) :
+ *   cc -mt -o racey racey.c magic.o
+ * (on linux with gcc)
+ *   gcc -m32 -lpthread -o racey racey.c
+ *
+ * DMP CHANGES:
+ * - PHASE_MARKER is removed
+ * - ProcessorIds is removed
+ * - MaxLoop is an optional command line parameter
+ * - Can spawn 32 threads (previous max was 15)
+ *
+ * WRITEFILE:
+ * - Each iteration writes one record to a file shared by all threads;
+ *   the order in which the records land is the race.  After the phase
+ *   main() reads the file back and mixes it into the signature.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+#include "racey-common.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+int MaxLoop = 50000;
+int Reps = 1;
+const char* WriteMode = "append";   /* --write */
+int RecordSize = 64;           /* --record */
+int Batch = 8;                 /* --batch: records per writev */
+#define PAGE_SIZE (1 << 10)
+#define MAX_RECORD (1 << 16)
+
+#define PRIME1   103072243
+#define PRIME2   103995407
+
+int               NumProcs;
+pthread_barrier_t barrier;       /* ThreadBody barrier */
+pthread_barrier_t repBarrier;    /* main + threads, between repetitions */
+int               globalfd;
+char              FileName[4096];
+
+const struct RaceyOption Options[] = {
+  { "reps", RACEY_INT, &Reps, "parallel phases per run, one signature each" },
+  { "write", RACEY_STR, &WriteMode, "how to write records: append, pwrite or writev" },
+  { "record", RACEY_INT, &RecordSize, "bytes per record, a multiple of 4 from 8 to 64K" },
+  { "batch", RACEY_INT, &Batch, "--write=writev: records per writev()" },
+  RACEY_SYNC_OPTIONS,
+  RACEY_COMMON_OPTIONS,
+  { NULL }
+};
+
+/*
+ * --write: append is one write() per record to an O_APPEND fd, so the
+ * kernel picks each record's offset.  pwrite reserves the record's
+ * offset with an atomic add and pwrite()s there.  writev appends
+ * --batch records at a time with one writev() to the O_APPEND fd.
+ */
+enum { WRITE_APPEND, WRITE_PWRITE, WRITE_WRITEV } WriteKind;
+volatile off_t    nextOffset;    /* pwrite: end of the reserved records */
+
+/* shared variables */
+char*    sigSlots;  /* sig[i], one cache line per thread */
+#define  SIG(i)   RACEY_SLOT(sigSlots, i, unsigned)
+
+/* per-thread counts for the metrics line, reset by InitShared() */
+struct WriteStats {
+  long long bytes;
+  long      syscalls;
+};
+char*    statSlots;
+#define  STATS(i) RACEY_SLOT(statSlots, i, struct WriteStats)
+
+
+/* the mix function */
+unsigned mix(unsigned i, unsigned j) {
+  return (i + j * PRIME2) % PRIME1;
+}
+
+/* (Re)initialize the shared variables before each parallel phase */
+void InitShared()
+{
+  int i, ret;
+  for(i = 0; i <= NumProcs; i++) {
+    SIG(i) = i;
+  }
+  memset(statSlots, 0, (size_t)(NumProcs + 1) * RACEY_CACHE_LINE);
+  ret = ftruncate(globalfd, 0);
+  assert(ret == 0);
+  nextOffset = 0;
+}
+
+/* Bytes and syscalls of the phase, for the metrics line */
+void PrintWriteMetrics(double secs)
+{
+  long long bytes = 0;
+  long syscalls = 0;
+  int i;
+
+  for(i = 1; i <= NumProcs; i++) {
+    bytes += STATS(i).bytes;
+    syscalls += STATS(i).syscalls;
+  }
+  printf(", \"write\": \"%s\", \"record\": %d, \"batch\": %d, "
+         "\"bytes\": %lld, \"bytes_per_sec\": %.0f, \"records_per_sec\": %.0f, "
+         "\"syscalls\": %ld, \"syscalls_per_sec\": %.0f",
+         WriteMode, RecordSize, WriteKind == WRITE_WRITEV ? Batch : 1,
+         bytes, secs > 0 ? bytes / secs : 0.0,
+         secs > 0 ? bytes / RecordSize / secs : 0.0,
+         syscalls, secs > 0 ? syscalls / secs : 0.0);
+}
+
+/* Fill rec with record i of thread threadId, chaining num */
+static unsigned FillRecord(unsigned* rec, int threadId, int i, unsigned num)
+{
+  int k;
+  rec[0] = threadId;
+  rec[1] = i;
+  for (k = 2; k < RecordSize / sizeof(unsigned); k++) {
+    num = mix(num, k);
+    rec[k] = num;
+  }
+  return num;
+}
+
+/* One parallel phase: barrier, then write MaxLoop records */
+void ParallelPhase(int threadId, char* buffer)
+{
+  const int fd = globalfd;
+  const int batch = (WriteKind == WRITE_WRITEV) ? Batch : 1;
+  struct WriteStats* st = &STATS(threadId);
+  struct iovec iov[batch];
+  unsigned num = SIG(threadId);
+  ssize_t len, r;
+  off_t off;
+  int i, k, n;
+
+  for (k = 0; k < batch; k++) {
+    iov[k].iov_base = buffer + (size_t)k * RecordSize;
+    iov[k].iov_len = RecordSize;
+  }
+
+  /* simple barrier, pass only once */
+  pthread_barrier_wait(&barrier);
+  RaceyPhaseBegin(threadId);
+
+  /*
+   * main loop:
+   *
+   * Each record is a pure function of the thread and the iteration;
+   * only where it lands in the file depends on the race.
+   */
+  for(i = 0; i < MaxLoop; i += n) {
+    n = (MaxLoop - i < batch) ? MaxLoop - i : batch;
+    for (k = 0; k < n; k++)
+      num = FillRecord(iov[k].iov_base, threadId, i + k, num);
+    len = (ssize_t)n * RecordSize;
+    switch (WriteKind) {
+    case WRITE_APPEND:
+      r = write(fd, buffer, len);
+      break;
+    case WRITE_PWRITE:
+      off = __sync_fetch_and_add(&nextOffset, len);
+      r = pwrite(fd, buffer, len, off);
+      break;
+    case WRITE_WRITEV:
+    default:
+      r = writev(fd, iov, n);
+      break;
+    }
+    if (r != len) {
+      perror("write");
+      exit(1);
+    }
+    st->syscalls++;
+    st->bytes += r;
+    RaceySyncPoint();
+  }
+  RaceyPhaseEnd(threadId, MaxLoop);
+
+  SIG(threadId) = num;
+}
+
+/* The function which is called once the thread is created */
+void* ThreadBody(void* tid)
+{
+  int threadId = *(int *) tid;
+  char* buffer;
+  int rep;
+
+  /* bind to a cpu (--pin) and seize it, roughly 0.5-1 second on ironsides */
+  RaceyPin(threadId - 1);
+  RaceyWarmup();
+
+  buffer = malloc((size_t)RecordSize * (WriteKind == WRITE_WRITEV ? Batch : 1));
+  assert(buffer != NULL);
+
+  for(rep = 0; rep < Reps; rep++) {
+    ParallelPhase(threadId, buffer);
+    /* let main() read the file back and truncate it */
+    if (rep < Reps - 1) {
+      pthread_barrier_wait(&repBarrier);
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* Read the file back: every record, in file order */
+unsigned HashFile(unsigned num)
+{
+  static unsigned words[PAGE_SIZE * 256];
+  const off_t want = (off_t)NumProcs * MaxLoop * RecordSize;
+  off_t off = 0;
+  ssize_t r;
+  int k;
+
+  while ((r = pread(globalfd, words, sizeof words, off)) > 0) {
+    for (k = 0; k < r / sizeof(unsigned); k++)
+      num = mix(num, words[k]);
+    off += r;
+  }
+  if (off != want) {
+    fprintf(stderr, "Error: %s holds %lld bytes, not %lld\n",
+            FileName, (long long)off, (long long)want);
+    exit(1);
+  }
+  return num;
+}
+
+int
+main(int argc, char* argv[])
+{
+  pthread_t*     threads;
+  int*           tids;
+  pthread_attr_t attr;
+  int            ret;
+  int            mix_sig, i, rep;
+
+  /* Parse arguments */
+  argc = RaceyParseArgs(argc, argv, Options);
+  if(argc < 2) {
+    fprintf(stderr, "%s <numProcesors> <maxLoop> [options]\n", argv[0]);
+    RaceyPrintOptions(Options);
+    exit(1);
+  }
+
+  NumProcs = atoi(argv[1]);
+  assert(NumProcs > 0);
+  if (argc >= 3) {
+    MaxLoop = atoi(argv[2]);
+    assert(MaxLoop > 0);
+  }
+  assert(Reps > 0);
+  if (RecordSize < 2 * (int)sizeof(unsigned) || RecordSize > MAX_RECORD ||
+      RecordSize % sizeof(unsigned)) {
+    fprintf(stderr, "--record=%d: want a multiple of %d from %d to %d\n",
+            RecordSize, (int)sizeof(unsigned), 2 * (int)sizeof(unsigned),
+            MAX_RECORD);
+    exit(1);
+  }
+  if (strcmp(WriteMode, "append") == 0)
+    WriteKind = WRITE_APPEND;
+  else if (strcmp(WriteMode, "pwrite") == 0)
+    WriteKind = WRITE_PWRITE;
+  else if (strcmp(WriteMode, "writev") == 0)
+    WriteKind = WRITE_WRITEV;
+  else {
+    fprintf(stderr, "unknown --write=%s\n", WriteMode);
+    exit(1);
+  }
+  assert(Batch > 0 && Batch <= sysconf(_SC_IOV_MAX));
+
+  /*
+   * Create the file, and unlink it right away: only our fd needs it.
+   * Appends go through O_APPEND, pwrite ignores it.
+   */
+  globalfd = RaceyMkstemp(FileName, sizeof FileName, "racey-write");
+  unlink(FileName);
+  if (WriteKind != WRITE_PWRITE &&
+      fcntl(globalfd, F_SETFL, O_APPEND) < 0) {
+    perror("fcntl");
+    return 1;
+  }
+  RaceySyncSetup(globalfd, NULL, 0);
+
+  /* Initialize sig[] */
+  sigSlots = RaceyAllocSlots(NumProcs + 1);
+  RaceyAllocPhases(NumProcs + 1, 0);
+  statSlots = RaceyAllocSlots(NumProcs + 1);
+  InitShared();
+
+  /* Initialize array of thread structures */
+  threads = (pthread_t *) malloc(sizeof(pthread_t) * NumProcs);
+  assert(threads != NULL);
+  tids = (int *) malloc(sizeof (int) * NumProcs);
+  assert(tids != NULL);
+
+  /* Initialize thread attribute */
+  pthread_attr_init(&attr);
+  pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+
+  ret = pthread_barrier_init(&barrier, NULL, NumProcs);
+  assert(ret == 0);
+  ret = pthread_barrier_init(&repBarrier, NULL, NumProcs + 1);
+  assert(ret == 0);
+  RaceyMetricsExtra = PrintWriteMetrics;
+
+  /*
+   * Setup is done: with --forkserver, each run starts here.  The child
+   * shares the file with the server, so truncate it after each run.
+   */
+  RaceyForkServer(NULL, InitShared);
+
+  for(i=0; i < NumProcs; i++) {
+    /* ************************************************************
+     * pthread_create takes 4 parameters
+     *  p1: threads(output)
+     *  p2: thread attribute
+     *  p3: start routine, where new thread begins
+     *  p4: arguments to the thread
+     * ************************************************************ */
+    tids[i] = i+1;
+    ret = pthread_create(&threads[i], &attr, ThreadBody, &tids[i]);
+    assert(ret == 0);
+  }
+
+  for(rep = 0; rep < Reps; rep++) {
+    if (rep < Reps - 1) {
+      /* Wait for the parallel phase to end */
+      pthread_barrier_wait(&repBarrier);
+    } else {
+      /* Wait for each of the threads to terminate */
+      for(i=0; i < NumProcs; i++) {
+        ret = pthread_join(threads[i], NULL);
+        assert(ret == 0);
+      }
+    }
+
+    /* compute the result: sig[], then the file in the order it was written */
+    mix_sig = SIG(0);
+    for(i = 1; i <= NumProcs ; i++) {
+      mix_sig = mix(SIG(i), mix_sig);
+    }
+    mix_sig = HashFile(mix_sig);
+
+    /* end of parallel phase */
+
+    /* ************************************************************
+     * print results
+     *  1. mix_sig  : deterministic race?
+     *  2. &mix_sig : deterministic stack layout?
+     *  3. malloc   : deterministic heap layout?
+     * ************************************************************ */
+    printf("\n\nShort signature: %08x @ %p @ %p\n\n\n",
+           mix_sig, &mix_sig, (void*)malloc(PAGE_SIZE/5));
+    fflush(stdout);
+    RaceyReportMetrics(mix_sig, 1, NumProcs);
+    usleep(5);
+
+    /* reset for the next parallel phase */
+    if (rep < Reps - 1) {
+      InitShared();
+      pthread_barrier_wait(&repBarrier);
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+  pthread_barrier_destroy(&barrier);
+  pthread_barrier_destroy(&repBarrier);
+
+  close(globalfd);
+
+  return 0;
+}
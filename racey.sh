@@ -7,8 +7,6 @@
 #
 
 
-for i in `seq 1 2000`;
-do
-	/home/wen/Projects/racey-suite/racey-forkpipe 32 50 | grep signature >> ~/racey_out
-	echo "rep $i"
-done
+# 2000 parallel phases in one process, one signature line each, from
+# the racey-forkpipe that make builds next to this script
+`dirname "$0"`/obj/racey-forkpipe --reps=2000 32 50 | grep "Short signature" >> ~/racey_out
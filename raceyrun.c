@@ -0,0 +1,585 @@
+/*
+ * raceyrun: a native replacement for the run loop in test.pl.
+ *
+ * test.pl starts every repetition through a perl pipe and waits for the
+ * runs one at a time.  This driver fork/execs the runs itself, gives each
+ * concurrently running job its own set of cpus, and reads the output of
+ * each job over a dedicated pipe, so all cores stay busy.  As runs finish
+ * it checks that every run printed the same "Short signature" line (with
+ * --native, the same signature value) and reports the number of runs per
+ * second.
+ *
+ * Usage is the same as test.pl (see --help).  By default enough jobs run
+ * in parallel to cover all online cpus, with <nproc> cpus per job.
+ *
+ * With --forkserver (native runs only), each job slot starts the program
+ * once as a fork server (see racey-common.h) and asks it for one forked
+ * child per run, so runs skip exec and setup.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 64
+#define FORKSRV_FD 198   /* control fd in the fork server, status is +1 */
+#define RACEY_STR_(x) #x
+#define RACEY_STR(x) RACEY_STR_(x)
+
+struct Job {
+  pid_t  pid;
+  int    fd;       /* read end of the job's output pipe */
+  int    slot;     /* which cpu set this job runs on */
+  char*  out;      /* everything the job wrote */
+  size_t len, cap;
+  pid_t  server;   /* with --forkserver: the server for this slot */
+  int    ctl, st;  /* ... and its control and status pipes */
+};
+
+/* command line */
+static int         NJobs;
+static int         NRep;
+static int         NProc;
+static int         QSize = -1;
+static const char* Mode = "MOT";
+static const char* Flags = "";
+static const char* NLoops = "50000";
+static const char* File = "";
+static const char* FileSize = "";
+static int         Native;
+static int         NoBuild;
+static int         ForkServer;
+
+/* cpus we are allowed to run on */
+static int         NCpus;
+static int*        Cpus;
+
+static void usage(void)
+{
+  fprintf(stderr,
+"Usage:\n"
+"  raceyrun [..progs..] -q <quantum-size> -m <mode> -X <rundetopts>\n"
+"                       -j <njobs> -n <nrep> -p <nproc> {--loops n}\n"
+"                       {--file <bigfile>} {--filesize <size>} {--native}\n"
+"                       {--forkserver} {--no-build}\n"
+"Where:\n"
+"  -q  quantum size\n"
+"  -m  deterministic execution mode (optional, defaults to 'MOT')\n"
+"  -X  extra options for rundet (optional, defaults to '')\n"
+"\n"
+"  -j  number of parallel jobs (optional, defaults to #cpus / nproc)\n"
+"  -n  number of repititions (should be >= 2)\n"
+"  -p  number of threads\n"
+"  --loops  loop size (optional, defaults to 50000)\n"
+"  --file   a big file (required for racey-readfile)\n"
+"  --filesize  generate --file first, with this many bytes (e.g. 64M);\n"
+"           --file defaults to racey-readfile.dat\n"
+"  --native    run the programs directly, without rundet (-q is ignored)\n"
+"  --forkserver  fork each run from a warmed-up fork server (needs --native)\n"
+"  --no-build  do not run make before testing\n"
+"\n"
+"Examples:\n"
+"  raceyrun basic guarded -n 100 -p 16 -q 10000 --loops 50000\n"
+"  raceyrun all -n 100 -p 16 -q 10000 -m MOT -j 4\n");
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Build the argv for one run.  Mirrors the command line built by
+ * startprog() in test.pl, minus the shell.
+ */
+static char** buildArgs(const char* prog, char** storage)
+{
+  static char* argv[MAX_ARGS];
+  static char  progpath[256], quantum[32], nproc[32], shim[4096];
+  char* flags;
+  char* tok;
+  int n = 0;
+
+  snprintf(progpath, sizeof progpath, "obj/racey-%s", prog);
+
+  if (!Native) {
+    argv[n++] = "../tools/obj/rundet";
+    snprintf(quantum, sizeof quantum, "%d", QSize);
+    argv[n++] = "-q";
+    argv[n++] = quantum;
+    argv[n++] = "-m";
+    argv[n++] = (char*)Mode;
+    flags = *storage = strdup(Flags);
+    for (tok = strtok(flags, " \t"); tok && n < MAX_ARGS - 8; tok = strtok(NULL, " \t"))
+      argv[n++] = tok;
+    if (strcmp(prog, "readfile") == 0) {
+      char* f = strdup(File);
+      snprintf(shim, sizeof shim, "--shim=dmpshim --localdir=%s,5,5,5,5", dirname(f));
+      free(f);
+      argv[n++] = shim;
+    }
+  }
+
+  snprintf(nproc, sizeof nproc, "%d", NProc);
+  argv[n++] = progpath;
+  argv[n++] = nproc;
+  argv[n++] = (char*)NLoops;
+  if (File[0])
+    argv[n++] = (char*)File;
+  if (ForkServer)
+    argv[n++] = "--forkserver=" RACEY_STR(FORKSRV_FD);
+  argv[n] = NULL;
+  return argv;
+}
+
+/*
+ * Start 'prog' on the cpus of 'slot', with its stdout going to job->fd.
+ * This is either one run, or with --forkserver the server for the slot.
+ */
+static int spawnJob(struct Job* job, const char* prog, int slot)
+{
+  char* storage = NULL;
+  char** argv = buildArgs(prog, &storage);
+  int fds[2], ctl[2], st[2];
+  pid_t pid;
+
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  if (ForkServer && (pipe(ctl) < 0 || pipe(st) < 0)) {
+    perror("pipe");
+    return -1;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    cpu_set_t set;
+    int i;
+    /* give this job its own set of cpus */
+    CPU_ZERO(&set);
+    for (i = 0; i < NProc; ++i)
+      CPU_SET(Cpus[(slot * NProc + i) % NCpus], &set);
+    sched_setaffinity(0, sizeof set, &set);
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    if (ForkServer) {
+      dup2(ctl[0], FORKSRV_FD);
+      dup2(st[1], FORKSRV_FD + 1);
+      close(ctl[0]); close(ctl[1]);
+      close(st[0]); close(st[1]);
+    }
+    execv(argv[0], argv);
+    fprintf(stderr, "exec %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  free(storage);
+  close(fds[1]);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  job->fd = fds[0];
+  job->slot = slot;
+  job->len = 0;
+  if (!ForkServer) {
+    job->pid = pid;
+    return 0;
+  }
+
+  /* output from one run ends at its status, not at EOF */
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  close(ctl[0]);
+  close(st[1]);
+  fcntl(ctl[1], F_SETFD, FD_CLOEXEC);
+  fcntl(st[0], F_SETFD, FD_CLOEXEC);
+  job->server = pid;
+  job->ctl = ctl[1];
+  job->st = st[0];
+  return 0;
+}
+
+/* Start one run of 'prog' on the cpus of 'slot' */
+static int startJob(struct Job* job, const char* prog, int slot)
+{
+  int req = 0;
+  pid_t pid;
+
+  if (!ForkServer)
+    return spawnJob(job, prog, slot);
+
+  if (!job->server && spawnJob(job, prog, slot) < 0)
+    return -1;
+  if (write(job->ctl, &req, sizeof req) != sizeof req ||
+      read(job->st, &pid, sizeof pid) != sizeof pid) {
+    fprintf(stderr, "fork server for racey-%s died\n", prog);
+    return -1;
+  }
+  job->pid = pid;
+  job->len = 0;
+  return 0;
+}
+
+/* Pull output from a job; returns 0 at EOF, -1 if nothing is ready */
+static int readJob(struct Job* job)
+{
+  ssize_t r;
+  if (job->cap - job->len < 4096) {
+    job->cap = job->cap ? job->cap * 2 : 16384;
+    job->out = realloc(job->out, job->cap);
+    assert(job->out != NULL);
+  }
+  r = read(job->fd, job->out + job->len, job->cap - job->len - 1);
+  if (r < 0 && errno == EINTR)
+    return 1;
+  if (r < 0 && errno == EAGAIN)
+    return -1;
+  if (r <= 0)
+    return 0;
+  job->len += r;
+  return 1;
+}
+
+/*
+ * Find the "Short signature" line in the output (like test.pl's regex).
+ * Native runs each get their own ASLR layout (so do the fork servers of
+ * different job slots), so for them only the %08x value is compared,
+ * not the "@ <stack> @ <heap>" pointers after it.
+ */
+static const char* findSignature(char* out, size_t* len)
+{
+  char* s = strstr(out, "Short signature:");
+  char* e;
+  if (!s)
+    return NULL;
+  while (s > out && s[-1] != '\n')
+    s--;
+  e = strchr(s, '\n');
+  *len = e ? (size_t)(e - s) : strlen(s);
+  if (Native && (e = memmem(s, *len, " @", 2)) != NULL)
+    *len = e - s;
+  return s;
+}
+
+static long findPid(const char* out)
+{
+  const char* p = strstr(out, "rundet: app{pid=");
+  return p ? atol(p + strlen("rundet: app{pid=")) : -1;
+}
+
+static void killJobs(struct Job* jobs, int njobs)
+{
+  int i;
+  for (i = 0; i < njobs; ++i) {
+    if (jobs[i].pid > 0) {
+      kill(jobs[i].pid, SIGKILL);
+      if (!ForkServer)
+        waitpid(jobs[i].pid, NULL, 0);
+      jobs[i].pid = 0;
+    }
+    if (jobs[i].server > 0) {
+      kill(jobs[i].server, SIGKILL);
+      waitpid(jobs[i].server, NULL, 0);
+      close(jobs[i].ctl);
+      close(jobs[i].st);
+      jobs[i].server = 0;
+    }
+    if (jobs[i].fd > 0) {
+      close(jobs[i].fd);
+      jobs[i].fd = 0;
+    }
+  }
+}
+
+static int testprog(const char* prog)
+{
+  struct Job* jobs = calloc(NJobs, sizeof(*jobs));
+  struct pollfd* pfds = calloc(NJobs * 2, sizeof(*pfds));
+  char* sig = NULL;
+  long goodpid = -1;
+  int started = 0, done = 0;
+  int diff, next, i;
+  double start = now();
+
+  assert(jobs != NULL && pfds != NULL);
+
+  printf("TESTING: racey-%s -m %s -n %d -p %d -q %d --loops=%s --file=%s -j %d\n",
+         prog, Mode, NRep, NProc, QSize, NLoops, File, NJobs);
+  fflush(stdout);
+
+  diff = NRep / 10;
+  if (5 < diff && diff < 10) diff = 10;
+  if (diff > 50) diff = 50;
+  if (diff < 1) diff = 1;
+  next = diff;
+
+  while (done < NRep) {
+    /* keep every slot busy */
+    for (i = 0; i < NJobs && started < NRep; ++i) {
+      if (jobs[i].pid == 0) {
+        if (startJob(&jobs[i], prog, i) < 0) {
+          killJobs(jobs, NJobs);
+          return 0;
+        }
+        started++;
+      }
+    }
+
+    /* pfds[2*i] is the output of job i, pfds[2*i+1] its fork server status */
+    for (i = 0; i < NJobs; ++i) {
+      pfds[2*i].fd = jobs[i].pid ? jobs[i].fd : -1;
+      pfds[2*i+1].fd = jobs[i].pid && ForkServer ? jobs[i].st : -1;
+      pfds[2*i].events = pfds[2*i+1].events = POLLIN;
+      pfds[2*i].revents = pfds[2*i+1].revents = 0;
+    }
+    if (poll(pfds, NJobs * 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      killJobs(jobs, NJobs);
+      return 0;
+    }
+
+    for (i = 0; i < NJobs; ++i) {
+      struct Job* job = &jobs[i];
+      const char* s;
+      size_t slen;
+      long pid;
+
+      if (!job->pid)
+        continue;
+      if (ForkServer) {
+        int status;
+        /* keep draining the output so the run never blocks on it */
+        if ((pfds[2*i].revents & (POLLIN|POLLHUP|POLLERR)) && readJob(job) == 0) {
+          fprintf(stderr, "fork server for racey-%s died\n", prog);
+          killJobs(jobs, NJobs);
+          return 0;
+        }
+        if (!(pfds[2*i+1].revents & (POLLIN|POLLHUP|POLLERR)))
+          continue;
+        if (read(job->st, &status, sizeof status) != sizeof status) {
+          fprintf(stderr, "fork server for racey-%s died\n", prog);
+          killJobs(jobs, NJobs);
+          return 0;
+        }
+        /* the run has exited, so all of its output is in the pipe */
+        while (readJob(job) > 0)
+          ;
+        pid = job->pid;
+      } else {
+        if (!(pfds[2*i].revents & (POLLIN|POLLHUP|POLLERR)) || readJob(job))
+          continue;
+        close(job->fd);
+        job->fd = 0;
+        waitpid(job->pid, NULL, 0);
+        pid = findPid(job->out);
+      }
+
+      /* job finished */
+      job->pid = 0;
+      job->out[job->len] = '\0';
+      done++;
+
+      s = findSignature(job->out, &slen);
+      if (!s) {
+        fprintf(stderr, "Bad output?\nI ran %s %d %s\n", prog, NProc, NLoops);
+        fprintf(stderr, "-----------------------------------\n");
+        fwrite(job->out, 1, job->len, stderr);
+        killJobs(jobs, NJobs);
+        return 0;
+      }
+      if (!sig)
+        sig = strndup(s, slen);
+      if (strlen(sig) != slen || strncmp(sig, s, slen) != 0) {
+        fprintf(stderr, "Failed at iteration %d:\n%s pid=%ld\n%.*s pid=%ld\n",
+                done, sig, goodpid, (int)slen, s, pid);
+        killJobs(jobs, NJobs);
+        return 0;
+      }
+      goodpid = pid;
+      if (done >= next) {
+        printf("OK: %d of %d (%.2f runs/sec)\n", done, NRep, done / (now() - start));
+        fflush(stdout);
+        next += diff;
+      }
+    }
+  }
+
+  printf("OK. %d runs in %.2f sec (%.2f runs/sec)\n",
+         done, now() - start, done / (now() - start));
+  fflush(stdout);
+  killJobs(jobs, NJobs);
+  for (i = 0; i < NJobs; ++i)
+    free(jobs[i].out);
+  free(jobs);
+  free(pfds);
+  free(sig);
+  return 1;
+}
+
+static int isProg(const char* p)
+{
+  char path[256];
+  struct stat st;
+  snprintf(path, sizeof path, "racey-%s.c", p);
+  return stat(path, &st) == 0;
+}
+
+/* Expand "all" into every racey-*.c in the current directory */
+static int addAll(const char** progs, int nprogs, int max)
+{
+  FILE* ls = popen("ls racey-*.c", "r");
+  char line[256];
+  if (!ls)
+    return nprogs;
+  while (nprogs < max && fgets(line, sizeof line, ls)) {
+    char* e = strstr(line, ".c");
+    if (!e)
+      continue;
+    *e = '\0';
+    progs[nprogs++] = strdup(line + strlen("racey-"));
+  }
+  pclose(ls);
+  return nprogs;
+}
+
+int
+main(int argc, char* argv[])
+{
+  static const struct option longopts[] = {
+    { "loops",    required_argument, NULL, 'L' },
+    { "file",     required_argument, NULL, 'F' },
+    { "filesize", required_argument, NULL, 'Z' },
+    { "native",   no_argument,       NULL, 'N' },
+    { "no-build", no_argument,       NULL, 'B' },
+    { "forkserver", no_argument,     NULL, 'S' },
+    { "help",     no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  const char* progs[256];
+  int nprogs = 0, all = 0, failed = 0;
+  cpu_set_t set;
+  int c, i;
+
+  while ((c = getopt_long(argc, argv, "q:m:j:n:p:X:h", longopts, NULL)) != -1) {
+    switch (c) {
+    case 'q': QSize = atoi(optarg); break;
+    case 'm': Mode = optarg; break;
+    case 'j': NJobs = atoi(optarg); break;
+    case 'n': NRep = atoi(optarg); break;
+    case 'p': NProc = atoi(optarg); break;
+    case 'X': Flags = optarg; break;
+    case 'L': NLoops = optarg; break;
+    case 'F': File = optarg; break;
+    case 'Z': FileSize = optarg; break;
+    case 'N': Native = 1; break;
+    case 'B': NoBuild = 1; break;
+    case 'S': ForkServer = 1; break;
+    default:  usage();
+    }
+  }
+
+  if (NRep == 0 || NProc == 0 || (QSize < 0 && !Native))
+    usage();
+  if (ForkServer && !Native) {
+    fprintf(stderr, "--forkserver needs --native.\n");
+    usage();
+  }
+  if (NJobs < 0) {
+    fprintf(stderr, "Bad value for -j (%d).\n", NJobs);
+    usage();
+  }
+  if (NRep < 2) {
+    fprintf(stderr, "Bad value for -n (%d).\n", NRep);
+    usage();
+  }
+
+  for (i = optind; i < argc && nprogs < 256; ++i) {
+    if (strcmp(argv[i], "all") == 0) {
+      all = 1;
+      continue;
+    }
+    if (!isProg(argv[i])) {
+      fprintf(stderr, "Unkown benchmark 'racey-%s'\n", argv[i]);
+      usage();
+    }
+    progs[nprogs++] = argv[i];
+  }
+  if (all)
+    nprogs = addAll(progs, 0, 256);
+  if (nprogs == 0) {
+    fprintf(stderr, "No programs specified.\n");
+    usage();
+  }
+  if (FileSize[0] && !File[0])
+    File = "racey-readfile.dat";
+  for (i = 0; i < nprogs; ++i) {
+    if (strcmp(progs[i], "readfile") == 0 && File[0] == '\0') {
+      fprintf(stderr, "No file specified for racey-readfile.\n");
+      usage();
+    }
+  }
+
+  /* Collect the cpus we may use, and size the job pool to cover them */
+  CPU_ZERO(&set);
+  sched_getaffinity(0, sizeof set, &set);
+  Cpus = malloc(sizeof(int) * CPU_SETSIZE);
+  assert(Cpus != NULL);
+  for (i = 0; i < CPU_SETSIZE; ++i)
+    if (CPU_ISSET(i, &set))
+      Cpus[NCpus++] = i;
+  if (NJobs == 0)
+    NJobs = NCpus / NProc > 0 ? NCpus / NProc : 1;
+
+  /* Build, with the DMP markers unless the runs are native */
+  if (!NoBuild) {
+    if (!Native) {
+      system("cd ../tools; make rundet dmpshim; cd ../test");
+      system("make MARKERS=-DRACEY_MARKERS_DMP");
+    } else {
+      system("make");
+    }
+  }
+
+  /* Generate --file natively, once, like test.pl */
+  for (i = 0; i < nprogs && FileSize[0]; ++i) {
+    if (strcmp(progs[i], "readfile") == 0) {
+      char cmd[1024];
+      snprintf(cmd, sizeof cmd,
+               "obj/racey-readfile 1 1 '%s' --generate='%s' --generate-only",
+               File, FileSize);
+      if (system(cmd) != 0) {
+        fprintf(stderr, "cannot generate %s\n", File);
+        return 1;
+      }
+      break;
+    }
+  }
+
+  /* Run */
+  for (i = 0; i < nprogs; ++i)
+    if (!testprog(progs[i]))
+      failed = 1;
+
+  return failed;
+}
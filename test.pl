@@ -16,13 +16,14 @@ my $mode = 'MOT';
 my $flags = '';
 my $nloops = '50000';
 my $file = '';
+my $filesize = '';
 
 sub usage {
   print STDERR <<EOF
 Usage:
   ./test.pl [..progs..] -q <quantum-size> -m <mode> -X <rundetopts>
                         -j <njobs> -n <nrep> -p <nproc> {--loops n}
-                        {--file <bigfile>}
+                        {--file <bigfile>} {--filesize <size>}
 Where:
   -q  quantum size
   -m  deterministic execution mode (optional, defaults to 'MOT')
@@ -33,6 +34,8 @@ Where:
   -p  number of threads
   --loops  loop size (optional, defaults to 50000)
   --file   a big file (required for racey-readfile)
+  --filesize  generate --file first, with this many bytes (e.g. 64M);
+           --file defaults to racey-readfile.dat
 
 Examples:
   ./test.pl basic nomutex -n 100 -p 16 -q 10000 --loops 50000
@@ -51,6 +54,7 @@ GetOptions(\%progs,
            'X=s' => \$flags,
            'loops=i' => \$nloops,
            'file=s' => \$file,
+           'filesize=s' => \$filesize,
            'help' => sub { usage(); });
 
 if (!defined($nrep) or !defined($nproc) or !defined($qsize)) {
@@ -88,6 +92,9 @@ if (!keys(%progs)) {
   usage();
 }
 
+if ($filesize ne '' and $file eq '') {
+  $file = 'racey-readfile.dat';
+}
 if ($progs{readfile} and $file eq '') {
   print STDERR "No file specified for racey-readfile.\n";
   usage();
@@ -97,7 +104,12 @@ if ($progs{readfile} and $file eq '') {
 # Build
 
 system("cd ../tools; make rundet dmpshim; cd ../test");
-system("make");
+system("make MARKERS=-DRACEY_MARKERS_DMP");
+
+if ($progs{readfile} and $filesize ne '') {
+  system("obj/racey-readfile 1 1 $file --generate=$filesize --generate-only") == 0
+    or die "cannot generate $file\n";
+}
 
 #------------------------------------------------------
 # Run (why did I do this in perl? ugh.)
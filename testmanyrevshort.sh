@@ -9,9 +9,15 @@ if [ ! -x "./test.pl" ]; then
   exit 1
 fi
 
+# prefer the compiled driver when it has been built
+RUN=./test.pl
+if [ -x "obj/raceyrun" ]; then
+  RUN=obj/raceyrun
+fi
+
 for p in "2" "8" "16"; do
-  ./test.pl "$@" -n 100 -p $p -q 100003 --loops 10000000 || exit 1
-  ./test.pl "$@" -n 100 -p $p -q  50003 --loops  5000000 || exit 1
-  ./test.pl "$@" -n 100 -p $p -q  10003 --loops   100000 || exit 1
-  ./test.pl "$@" -n 100 -p $p -q   1003 --loops    10000 || exit 1
+  $RUN "$@" -n 100 -p $p -q 100003 --loops 10000000 || exit 1
+  $RUN "$@" -n 100 -p $p -q  50003 --loops  5000000 || exit 1
+  $RUN "$@" -n 100 -p $p -q  10003 --loops   100000 || exit 1
+  $RUN "$@" -n 100 -p $p -q   1003 --loops    10000 || exit 1
 done